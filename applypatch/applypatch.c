@@ -28,6 +28,7 @@
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 #include "mtdutils/mtdutils.h"
+#include "mtdutils/partitions.h"
 #include "edify/expr.h"
 
 /*[FEATURE]-ADD by ling.yi@jrdcom.com, 2013/11/08, Bug 550459, FOTA porting  begin*/
@@ -46,9 +47,9 @@ static int GenerateTarget(FileContents* source_file,
                           const char* target_filename,
                           const uint8_t target_sha1[SHA_DIGEST_SIZE],
                           size_t target_size,
-                          const Value* bonus_data);
+                          const Value* bonus_data,
+                          int use_cache);
 
-static int mtd_partitions_scanned = 0;
 
 // Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
@@ -107,10 +108,29 @@ int LoadFileContents(const char* filename, FileContents* file,
         }
     }
 
-    SHA(file->data, file->size, file->sha1);
+    // The data has to be read, since the caller wants it, but if it was
+    // hashed before it needn't be hashed again.
+    if (FindCachedFileSha1(filename, &file->st, retouch_flag,
+                           file->sha1) != 0) {
+        SHA(file->data, file->size, file->sha1);
+        CacheFileSha1(filename, &file->st, retouch_flag, file->sha1);
+    }
     return 0;
 }
 
+// Make the hash cache's name for the partition in filename
+// ("MTD:<name>" or "EMMC:<device>", dropping any size and sha1 pairs).
+static void PartitionCacheKey(const char* filename, char* key, size_t size) {
+    const char* colon = strchr(filename, ':');
+    size_t len = strlen(filename);
+    if (colon != NULL && (colon = strchr(colon+1, ':')) != NULL) {
+        len = colon - filename;
+    }
+    if (len >= size) len = size-1;
+    memcpy(key, filename, len);
+    key[len] = '\0';
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -195,22 +215,21 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
     MtdReadContext* ctx = NULL;
     FILE* dev = NULL;
+    const PartitionInfo* info;
 
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
-
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            info = partition_index_find(PARTITION_MTD, partition);
+            const MtdPartition* mtd = info ? info->mtd : NULL;
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
                 return -1;
             }
 
-            ctx = mtd_read_partition(mtd);
+            // The whole partition is usually read, so read a megabyte
+            // at a time rather than a block.
+            ctx = mtd_read_partition_readahead(mtd, 1024 * 1024);
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
@@ -230,6 +249,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_CTX sha_ctx;
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
+    char cache_key[256];
+    PartitionCacheKey(filename, cache_key, sizeof(cache_key));
 
     // allocate enough memory to hold the largest size.
     file->data = malloc(size[index[pairs-1]]);
@@ -268,6 +289,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         SHA_CTX temp_ctx;
         memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
         const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        CachePartitionSha1(cache_key, file->size, sha_so_far);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
@@ -328,6 +350,22 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 }
 
 
+// Return the largest of the sizes listed in a partition filename of
+// the form described above LoadPartitionContents(), or 0 if it lists
+// none.
+size_t LargestPartitionSize(const char* filename) {
+    size_t largest = 0;
+    const char* p = strchr(filename, ':');
+    if (p) p = strchr(p+1, ':');            // skip the partition name
+    while (p != NULL) {
+        size_t size = strtoul(p+1, NULL, 10);
+        if (size > largest) largest = size;
+        p = strchr(p+1, ':');               // skip the size
+        if (p) p = strchr(p+1, ':');        // skip the sha1
+    }
+    return largest;
+}
+
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
 int SaveFileContents(const char* filename, const FileContents* file) {
@@ -385,14 +423,15 @@ int WriteToPartition(unsigned char* data, size_t len,
         return -1;
     }
 
+    // Whatever was known of the partition's contents is about to be
+    // wrong.
+    ForgetPartitionSha1s();
+
+    const PartitionInfo* info;
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
-
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            info = partition_index_find(PARTITION_MTD, partition);
+            const MtdPartition* mtd = info ? info->mtd : NULL;
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
                        partition);
@@ -428,6 +467,13 @@ int WriteToPartition(unsigned char* data, size_t len,
 
         case EMMC:
         {
+            info = partition_index_find(PARTITION_EMMC, partition);
+            if (info != NULL && info->size > 0 && len > info->size) {
+                printf("%zu bytes don't fit in %s (%llu bytes)\n",
+                       len, partition, info->size);
+                return -1;
+            }
+
             size_t start = 0;
             int success = 0;
             int fd = open(partition, O_RDWR | O_SYNC);
@@ -585,6 +631,42 @@ int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
     return -1;
 }
 
+// Find the sha1 that LoadFileContents() would give for filename
+// without reading it, if it was hashed before and hasn't changed
+// since.  For a partition, that's the hash of the first of the
+// filename's (size, sha1) pairs found to match.  Returns 0 if
+// the hash is known.
+static int FindCachedSha1(const char* filename, uint8_t* sha1) {
+    if (strncmp(filename, "MTD:", 4) != 0 &&
+        strncmp(filename, "EMMC:", 5) != 0) {
+        return GetCachedFileSha1(filename, RETOUCH_DO_MASK, sha1);
+    }
+
+    char key[256];
+    PartitionCacheKey(filename, key, sizeof(key));
+    const char* p = filename + strlen(key);
+    while (*p == ':') {
+        char* end;
+        size_t size = strtol(p+1, &end, 10);
+        if (*end != ':') break;
+        uint8_t parsed[SHA_DIGEST_SIZE];
+        char sha1_str[SHA_DIGEST_SIZE*2+1];
+        const char* next = strchr(end+1, ':');
+        size_t len = next ? (size_t)(next - (end+1)) : strlen(end+1);
+        if (len >= sizeof(sha1_str)) break;
+        memcpy(sha1_str, end+1, len);
+        sha1_str[len] = '\0';
+        if (ParseSha1(sha1_str, parsed) == 0 &&
+            FindCachedPartitionSha1(key, size, sha1) == 0 &&
+            memcmp(sha1, parsed, SHA_DIGEST_SIZE) == 0) {
+            return 0;
+        }
+        if (next == NULL) break;
+        p = next;
+    }
+    return -1;
+}
+
 // Returns 0 if the contents of the file (argv[2]) or the cached file
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
@@ -593,6 +675,13 @@ int applypatch_check(const char* filename,
     FileContents file;
     file.data = NULL;
 
+    // Nothing needs to be read if the contents are known to match.
+    if (FindCachedSha1(filename, file.sha1) == 0 &&
+        (num_patches == 0 ||
+         FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) >= 0)) {
+        return 0;
+    }
+
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
@@ -664,6 +753,11 @@ ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
     return len;
 }
 
+int IsPartition(const char* filename) {
+    return strncmp(filename, "MTD:", 4) == 0 ||
+           strncmp(filename, "EMMC:", 5) == 0;
+}
+
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -719,6 +813,16 @@ static void print_short_sha1(const uint8_t sha1[SHA_DIGEST_SIZE]) {
 // See the comments for the LoadPartition Contents() function above
 // for the format of such a filename.
 
+static int ApplyPatch(const char* source_filename,
+                      const char* target_filename,
+                      const char* target_sha1_str,
+                      size_t target_size,
+                      int num_patches,
+                      char** const patch_sha1_str,
+                      Value** patch_data,
+                      Value* bonus_data,
+                      int use_cache);
+
 int applypatch(const char* source_filename,
                const char* target_filename,
                const char* target_sha1_str,
@@ -727,6 +831,33 @@ int applypatch(const char* source_filename,
                char** const patch_sha1_str,
                Value** patch_data,
                Value* bonus_data) {
+    return ApplyPatch(source_filename, target_filename, target_sha1_str,
+                      target_size, num_patches, patch_sha1_str, patch_data,
+                      bonus_data, 1);
+}
+
+int applypatch_without_cache(const char* source_filename,
+                             const char* target_filename,
+                             const char* target_sha1_str,
+                             size_t target_size,
+                             int num_patches,
+                             char** const patch_sha1_str,
+                             Value** patch_data,
+                             Value* bonus_data) {
+    return ApplyPatch(source_filename, target_filename, target_sha1_str,
+                      target_size, num_patches, patch_sha1_str, patch_data,
+                      bonus_data, 0);
+}
+
+static int ApplyPatch(const char* source_filename,
+                      const char* target_filename,
+                      const char* target_sha1_str,
+                      size_t target_size,
+                      int num_patches,
+                      char** const patch_sha1_str,
+                      Value** patch_data,
+                      Value* bonus_data,
+                      int use_cache) {
     printf("patch %s: ", source_filename);
 
     if (target_filename[0] == '-' &&
@@ -747,6 +878,15 @@ int applypatch(const char* source_filename,
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
+    uint8_t cached_sha1[SHA_DIGEST_SIZE];
+    if (FindCachedSha1(target_filename, cached_sha1) == 0 &&
+        memcmp(cached_sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
+        printf("already ");
+        print_short_sha1(target_sha1);
+        putchar('\n');
+        return 0;
+    }
+
     // We try to load the target file into the source_file object.
     if (LoadFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
@@ -783,6 +923,10 @@ int applypatch(const char* source_filename,
     if (source_patch_value == NULL) {
         free(source_file.data);
         source_file.data = NULL;
+        if (!use_cache) {
+            printf("source file is bad; copy needed\n");
+            return APPLYPATCH_NEEDS_CACHE;
+        }
         printf("source file is bad; trying copy\n");
 
         if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
@@ -809,7 +953,8 @@ int applypatch(const char* source_filename,
     int result = GenerateTarget(&source_file, source_patch_value,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
-                                target_sha1, target_size, bonus_data);
+                                target_sha1, target_size, bonus_data,
+                                use_cache);
     free(source_file.data);
     free(copy_file.data);
 
@@ -824,7 +969,8 @@ static int GenerateTarget(FileContents* source_file,
                           const char* target_filename,
                           const uint8_t target_sha1[SHA_DIGEST_SIZE],
                           size_t target_size,
-                          const Value* bonus_data) {
+                          const Value* bonus_data,
+                          int use_cache) {
     int retry = 1;
     SHA_CTX ctx;
     int output;
@@ -860,6 +1006,10 @@ static int GenerateTarget(FileContents* source_file,
 
             // We still write the original source to cache, in case
             // the partition write is interrupted.
+            if (!use_cache) {
+                printf("/cache copy needed\n");
+                return APPLYPATCH_NEEDS_CACHE;
+            }
             if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                 printf("not enough free space on /cache\n");
                 return 1;
@@ -875,7 +1025,7 @@ static int GenerateTarget(FileContents* source_file,
             if (retry > 0) {
                 size_t free_space = FreeSpaceForFile(target_fs);
                 enough_space =
-                    (free_space > (256 << 10)) &&          // 256k (two-block) minimum
+                    (free_space > MIN_TARGET_FREE) &&
                     (free_space > (target_size * 3 / 2));  // 50% margin of error
                 if (!enough_space) {
                     printf("target %ld bytes; free space %ld bytes; retry %d; enough %d\n",
@@ -902,6 +1052,11 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
 
+                if (!use_cache) {
+                    printf("/cache copy needed\n");
+                    return APPLYPATCH_NEEDS_CACHE;
+                }
+
                 if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                     printf("not enough free space on /cache\n");
                     return 1;
@@ -1024,6 +1179,10 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
         free(msi.buffer);
+
+        char key[256];
+        PartitionCacheKey(target_filename, key, sizeof(key));
+        CachePartitionSha1(key, target_size, target_sha1);
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
@@ -1045,6 +1204,14 @@ static int GenerateTarget(FileContents* source_file,
         }
         /*Add by baijian sync data to emmc*/
         sync();
+
+        // These are exactly the bytes that were hashed, so a later
+        // unmasked read of the target needn't hash them again.
+        struct stat st;
+        if (stat(target_filename, &st) == 0) {
+            CacheFileSha1(target_filename, &st, RETOUCH_DONT_MASK,
+                          target_sha1);
+        }
     }
 
     // If this run of applypatch created the copy, and we're here, we
@@ -1071,6 +1238,10 @@ int set_fota_flag(bool flag) {
     value = 0;
   }
 
+  // Whatever was known of the partition's contents is about to be
+  // wrong.
+  ForgetPartitionSha1s();
+
   int fd = open(FOTA_PARTITION, O_WRONLY);
   if (fd < 0) {
      printf("open %s failed\n", FOTA_PARTITION);
@@ -18,10 +18,22 @@
 #define _APPLYPATCH_H
 
 #include <sys/stat.h>
+#include <time.h>
 #include "mincrypt/sha.h"
 #include "minelf/Retouch.h"
 #include "edify/expr.h"
 
+// STAT_TIME(st, m) and STAT_TIME(st, c) are the modification and
+// change times of the struct stat* st, as struct timespecs.  Older
+// bionic has st_mtime and st_mtime_nsec fields instead of st_mtim
+// (which the libcs that have it alias st_mtime to).
+#ifdef st_mtime
+#define STAT_TIME(st, x) ((st)->st_##x##tim)
+#else
+#define STAT_TIME(st, x) \
+    ((struct timespec){ (st)->st_##x##time, (st)->st_##x##time_nsec })
+#endif
+
 typedef struct _Patch {
   uint8_t sha1[SHA_DIGEST_SIZE];
   const char* patch_filename;
@@ -43,8 +55,15 @@ typedef struct _FileContents {
 
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
+// applypatch() only writes a patched file in place if the target
+// filesystem has more than this free, and 50% more than the target's
+// size; otherwise it goes through the /cache copy of the source.
+#define MIN_TARGET_FREE (256 << 10)   // 256k (two-block) minimum
+
 // applypatch.c
 int ShowLicenses();
+// Nonzero if filename names a partition ("MTD:..." or "EMMC:...").
+int IsPartition(const char* filename);
 size_t FreeSpaceForFile(const char* filename);
 int CacheSizeCheck(size_t bytes);
 int ParseSha1(const char* str, uint8_t* digest);
@@ -57,12 +76,26 @@ int applypatch(const char* source_filename,
                char** const patch_sha1_str,
                Value** patch_data,
                Value* bonus_data);
+// Like applypatch(), but rather than go through the /cache copy of
+// the source (which there is only one of), returns
+// APPLYPATCH_NEEDS_CACHE, leaving the target as it was.  Safe to run
+// on several threads at once, for distinct sources and targets.
+int applypatch_without_cache(const char* source_filename,
+                             const char* target_filename,
+                             const char* target_sha1_str,
+                             size_t target_size,
+                             int num_patches,
+                             char** const patch_sha1_str,
+                             Value** patch_data,
+                             Value* bonus_data);
+#define APPLYPATCH_NEEDS_CACHE 2
 int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+size_t LargestPartitionSize(const char* filename);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
@@ -85,6 +118,23 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
+
+// hashcache.c
+int FindCachedFileSha1(const char* filename, const struct stat* st,
+                       int retouch_flag, uint8_t* sha1);
+void CacheFileSha1(const char* filename, const struct stat* st,
+                   int retouch_flag, const uint8_t* sha1);
+// Stat filename and look up its hash; returns 0 if it's known.
+int GetCachedFileSha1(const char* filename, int retouch_flag,
+                      uint8_t* sha1);
+// partition is "MTD:<name>" or "EMMC:<device>"; size is the length
+// of the prefix hashed.
+int FindCachedPartitionSha1(const char* partition, size_t size,
+                            uint8_t* sha1);
+void CachePartitionSha1(const char* partition, size_t size,
+                        const uint8_t* sha1);
+// Call whenever a partition may have been written.
+void ForgetPartitionSha1s();
 /*[FEATURE]-ADD by ling.yi@jrdcom.com, 2013/11/08, Bug 550459, FOTA porting  begin*/
 #ifdef FEATURE_TCT_FULL_UPDATE
 int set_fota_flag(bool flag);
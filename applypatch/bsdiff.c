@@ -221,6 +221,20 @@ static void offtout(off_t x,u_char *buf)
 //      bsdiff() multiple times with the same 'old' data, we only do
 //      the qsufsort() step the first time.
 //
+// Callers that share one 'old' between several threads can call
+// bsdiff_sort() up front, so that bsdiff() only ever reads *IP.
+//
+void bsdiff_sort(u_char* old, off_t oldsize, off_t** IP)
+{
+        if (*IP == NULL) {
+            off_t* V;
+            *IP = malloc((oldsize+1) * sizeof(off_t));
+            V = malloc((oldsize+1) * sizeof(off_t));
+            qsufsort(*IP, V, old, oldsize);
+            free(V);
+        }
+}
+
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
@@ -240,13 +254,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	BZFILE * pfbz2;
 	int bz2err;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
+        bsdiff_sort(old, oldsize, IP);
         I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,7 +12,67 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// We're allowed to delete unopened regular files in any of these
+// directories.
+static const char* dirs[] = {"/cache", "/cache/recovery/otatest"};
+#define NUM_DIRS (sizeof(dirs)/sizeof(dirs[0]))
+
+typedef struct {
+  char* name;
+  size_t size;
+  int open;
+} ExpendableFile;
+
+// The regular files found in the directories by the last scan (sorted
+// by name), and the mtimes the directories had at the time.  Files
+// can't have been added to or removed from the directories while
+// their mtimes are unchanged, so until then the listing is reused
+// instead of reading the directories again.  Opening a file doesn't
+// change its directory, though, so which files are open is found out
+// from /proc on every call.  All guarded by listing_lock.
+static ExpendableFile* listing = NULL;
+static int listing_count = 0;
+static struct timespec listing_mtimes[NUM_DIRS];
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ReadDirMtimes(struct timespec* mtimes) {
+  unsigned int i;
+  for (i = 0; i < NUM_DIRS; ++i) {
+    struct stat st;
+    if (stat(dirs[i], &st) == 0) {
+      mtimes[i] = STAT_TIME(&st, m);
+    } else {
+      mtimes[i].tv_sec = 0;
+      mtimes[i].tv_nsec = 0;
+    }
+  }
+}
+
+static int SameMtimes(const struct timespec* a, const struct timespec* b) {
+  unsigned int i;
+  for (i = 0; i < NUM_DIRS; ++i) {
+    if (a[i].tv_sec != b[i].tv_sec || a[i].tv_nsec != b[i].tv_nsec) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(((const ExpendableFile*)a)->name,
+                ((const ExpendableFile*)b)->name);
+}
+
+static int compare_sizes_descending(const void* a, const void* b) {
+  size_t sa = (*(ExpendableFile* const*)a)->size;
+  size_t sb = (*(ExpendableFile* const*)b)->size;
+  return (sa < sb) - (sa > sb);
+}
+
+// Mark every file in files[] (which must be sorted by name) that some
+// process has open.  This walks /proc/<pid>/fd just once, looking
+// each link under /cache up in files[] by binary search.
+static int EliminateOpenFiles(ExpendableFile* files, int file_count) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -49,17 +110,15 @@ static int EliminateOpenFiles(char** files, int file_count) {
       if (count >= 0) {
         link[count] = '\0';
 
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
         if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
+          ExpendableFile key;
+          key.name = link;
+          ExpendableFile* match = bsearch(&key, files, file_count,
+                                          sizeof(ExpendableFile),
+                                          compare_names);
+          if (match != NULL && !match->open) {
+            printf("%s is open by %s\n", link, de->d_name);
+            match->open = 1;
           }
         }
       }
@@ -71,21 +130,38 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+static void FreeListing() {
+  int i;
+  for (i = 0; i < listing_count; ++i) {
+    free(listing[i].name);
+  }
+  free(listing);
+  listing = NULL;
+  listing_count = 0;
+}
+
+// Fill in listing[] with the regular files in dirs[], unless the
+// listing from the last call is still good.
+static void ListDirs() {
+  struct timespec mtimes[NUM_DIRS];
+  ReadDirMtimes(mtimes);
+  if (listing != NULL && SameMtimes(mtimes, listing_mtimes)) {
+    printf("%d regular files in deletable directories (cached)\n",
+           listing_count);
+    return;
+  }
+  FreeListing();
+
   DIR* d;
   struct dirent* de;
   int size = 32;
-  *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  int entries = 0;
+  ExpendableFile* files = malloc(size * sizeof(ExpendableFile));
 
   char path[FILENAME_MAX];
 
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
-
   unsigned int i;
-  for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
+  for (i = 0; i < NUM_DIRS; ++i) {
     d = opendir(dirs[i]);
     if (d == NULL) {
       printf("error opening %s: %s\n", dirs[i], strerror(errno));
@@ -105,27 +181,56 @@ int FindExpendableFiles(char*** names, int* entries) {
 
       struct stat st;
       if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
+        if (entries >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          files = realloc(files, size * sizeof(ExpendableFile));
         }
-        (*names)[(*entries)++] = strdup(path);
+        files[entries].name = strdup(path);
+        files[entries].size = st.st_size;
+        files[entries].open = 0;
+        ++entries;
       }
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
+  printf("%d regular files in deletable directories\n", entries);
+
+  qsort(files, entries, sizeof(ExpendableFile), compare_names);
+  listing = files;
+  listing_count = entries;
+  memcpy(listing_mtimes, mtimes, sizeof(mtimes));
+}
+
+// Set *result to the unopened files in the listing, biggest first, and
+// return how many there are (or -1).  The array is to be freed by the
+// caller; its entries belong to listing[].
+static int FindExpendableFiles(ExpendableFile*** result) {
+  ListDirs();
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
+  int i;
+  for (i = 0; i < listing_count; ++i) {
+    listing[i].open = 0;
+  }
+  if (EliminateOpenFiles(listing, listing_count) < 0) {
     return -1;
   }
 
-  return 0;
+  ExpendableFile** files = malloc((listing_count + 1) * sizeof(ExpendableFile*));
+  int count = 0;
+  for (i = 0; i < listing_count; ++i) {
+    if (!listing[i].open) {
+      files[count++] = &listing[i];
+    }
+  }
+  qsort(files, count, sizeof(ExpendableFile*), compare_sizes_descending);
+
+  *result = files;
+  return count;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
+static int MakeFreeSpace(size_t bytes_needed) {
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%ld bytes free on /cache (%ld needed)\n",
          (long)free_now, (long)bytes_needed);
@@ -134,39 +239,49 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
-  int entries;
-
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  ExpendableFile** files;
+  int count = FindExpendableFiles(&files);
+  if (count < 0) {
     return -1;
   }
 
-  if (entries == 0) {
+  if (count == 0) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
+    free(files);
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
+  // Delete the biggest files first, so that as few files as possible
+  // are lost.
   int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
-    }
+  for (i = 0; i < count && free_now < bytes_needed; ++i) {
+    unlink(files[i]->name);
+    free_now = FreeSpaceForFile("/cache");
+    printf("deleted %s; now %ld bytes free\n", files[i]->name, (long)free_now);
+    free(files[i]->name);
+    files[i]->name = NULL;
   }
+  free(files);
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  // Drop the deleted files from the listing; our own unlink()s changed
+  // the directory mtimes, so record the new ones to keep the rest of
+  // the listing valid.
+  int j = 0;
+  for (i = 0; i < listing_count; ++i) {
+    if (listing[i].name != NULL) {
+      listing[j++] = listing[i];
+    }
   }
-  free(names);
+  listing_count = j;
+  ReadDirMtimes(listing_mtimes);
 
   return (free_now >= bytes_needed) ? 0 : -1;
 }
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  pthread_mutex_lock(&listing_lock);
+  int result = MakeFreeSpace(bytes_needed);
+  pthread_mutex_unlock(&listing_lock);
+  return result;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The SHA-1s of everything LoadFileContents() has read, so that a
+// later check of the same bytes needn't read them again.  An OTA
+// script typically checks every file with apply_patch_check() or
+// sha1_check(read_file(...)) before patching it.
+//
+// A file's hash is only reused while its device, inode, size, mtime
+// and ctime (to the nanosecond, so a rewrite within the same second
+// is noticed) are unchanged; anything that rewrites it changes at
+// least one of them.  A partition's hashes are of prefixes of it, and
+// are forgotten whenever a partition might have been written.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "applypatch.h"
+
+#define HASH_BUCKETS 1024
+
+typedef struct HashCacheEntry {
+    char* name;             // file path, or "MTD:<name>"/"EMMC:<device>"
+    int retouch_flag;       // files only
+    int partition;
+    dev_t dev;
+    ino_t ino;
+    off_t size;             // for partitions, the length of the prefix
+    struct timespec mtime;
+    struct timespec ctime;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    struct HashCacheEntry* next;
+} HashCacheEntry;
+
+static HashCacheEntry* buckets[HASH_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int Bucket(const char* name) {
+    unsigned int h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % HASH_BUCKETS;
+}
+
+// Find the entry for a file, or for a prefix of a partition.  Call
+// with the lock held.
+static HashCacheEntry* FindEntry(const char* name, int partition,
+                                 int retouch_flag, off_t size) {
+    HashCacheEntry* e;
+    for (e = buckets[Bucket(name)]; e != NULL; e = e->next) {
+        if (e->partition == partition && strcmp(e->name, name) == 0 &&
+            (partition ? e->size == size : e->retouch_flag == retouch_flag)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static HashCacheEntry* AddEntry(const char* name, int partition,
+                                int retouch_flag, off_t size) {
+    HashCacheEntry* e = FindEntry(name, partition, retouch_flag, size);
+    if (e == NULL) {
+        unsigned int b = Bucket(name);
+        e = calloc(1, sizeof(HashCacheEntry));
+        e->name = strdup(name);
+        e->partition = partition;
+        e->retouch_flag = retouch_flag;
+        e->size = size;
+        e->next = buckets[b];
+        buckets[b] = e;
+    }
+    return e;
+}
+
+static int SameTime(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static int SameFile(const HashCacheEntry* e, const struct stat* st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->size == st->st_size && SameTime(e->mtime, STAT_TIME(st, m)) &&
+           SameTime(e->ctime, STAT_TIME(st, c));
+}
+
+int FindCachedFileSha1(const char* filename, const struct stat* st,
+                       int retouch_flag, uint8_t* sha1) {
+    int result = -1;
+    pthread_mutex_lock(&lock);
+    HashCacheEntry* e = FindEntry(filename, 0, retouch_flag, 0);
+    if (e != NULL && SameFile(e, st)) {
+        memcpy(sha1, e->sha1, SHA_DIGEST_SIZE);
+        result = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void CacheFileSha1(const char* filename, const struct stat* st,
+                   int retouch_flag, const uint8_t* sha1) {
+    pthread_mutex_lock(&lock);
+    HashCacheEntry* e = AddEntry(filename, 0, retouch_flag, 0);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = STAT_TIME(st, m);
+    e->ctime = STAT_TIME(st, c);
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+    pthread_mutex_unlock(&lock);
+}
+
+int FindCachedPartitionSha1(const char* partition, size_t size,
+                            uint8_t* sha1) {
+    int result = -1;
+    pthread_mutex_lock(&lock);
+    HashCacheEntry* e = FindEntry(partition, 1, 0, size);
+    if (e != NULL) {
+        memcpy(sha1, e->sha1, SHA_DIGEST_SIZE);
+        result = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void CachePartitionSha1(const char* partition, size_t size,
+                        const uint8_t* sha1) {
+    pthread_mutex_lock(&lock);
+    HashCacheEntry* e = AddEntry(partition, 1, 0, size);
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+    pthread_mutex_unlock(&lock);
+}
+
+void ForgetPartitionSha1s() {
+    pthread_mutex_lock(&lock);
+    int b;
+    for (b = 0; b < HASH_BUCKETS; ++b) {
+        HashCacheEntry** p = &buckets[b];
+        while (*p != NULL) {
+            HashCacheEntry* e = *p;
+            if (e->partition) {
+                *p = e->next;
+                free(e->name);
+                free(e);
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int GetCachedFileSha1(const char* filename, int retouch_flag,
+                      uint8_t* sha1) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return -1;
+    }
+    return FindCachedFileSha1(filename, &st, retouch_flag, sha1);
+}
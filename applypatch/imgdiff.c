@@ -122,6 +122,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -131,6 +132,7 @@
 
 #include "zlib.h"
 #include "imgdiff.h"
+#include "imgdiff_cache.h"
 #include "utils.h"
 
 typedef struct {
@@ -157,6 +159,10 @@ typedef struct {
   int level, method, windowBits, memLevel, strategy;
 
   size_t source_uncompressed_len;
+
+  // SHA-1 of data, used as the key into the patch cache.
+  int have_sha1;
+  uint8_t sha1[SHA_DIGEST_SIZE];
 } ImageChunk;
 
 typedef struct {
@@ -181,6 +187,7 @@ static int fileentry_compare(const void* a, const void* b) {
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void bsdiff_sort(u_char* old, off_t oldsize, off_t** IP);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -577,7 +584,6 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
   unsigned char* out = malloc(BUFFER_SIZE);
 
   // We only check two combinations of encoder parameters:  level 6
@@ -598,24 +604,40 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+static const uint8_t* ChunkSha1(ImageChunk* ch) {
+  if (!ch->have_sha1) {
+    CacheDigest(ch->data, ch->len, ch->sha1);
+    ch->have_sha1 = 1;
+  }
+  return ch->sha1;
+}
+
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Make sure the bsdiff suffix array for the chunk is built, taking it
+ * from the cache if it's there (and adding it if it wasn't).
  */
-unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
-  if (tgt->type == CHUNK_NORMAL) {
-    if (tgt->len <= 160) {
-      tgt->type = CHUNK_RAW;
-      *size = tgt->len;
-      return tgt->data;
-    }
+static void SortSourceChunk(ImageChunk* src) {
+  if (src->I != NULL) return;
+  if (CacheEnabled()) {
+    src->I = CacheFindSuffixArray(ChunkSha1(src), src->len);
+    if (src->I != NULL) return;
   }
+  bsdiff_sort(src->data, src->len, &(src->I));
+  if (CacheEnabled()) {
+    CacheStoreSuffixArray(ChunkSha1(src), src->I, src->len);
+  }
+}
 
+/*
+ * Run bsdiff on the source and target chunk data.  Return the patch
+ * data, placing its length in *size.  Return NULL on failure.
+ */
+static unsigned char* RunBsdiff(ImageChunk* src, ImageChunk* tgt,
+                                size_t* size) {
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
   mkstemp(ptemp);
 
+  SortSourceChunk(src);
   int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
@@ -630,15 +652,6 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   }
 
   unsigned char* data = malloc(st.st_size);
-
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
-
-    tgt->type = CHUNK_RAW;
-    *size = tgt->len;
-    return tgt->data;
-  }
-
   *size = st.st_size;
 
   FILE* f = fopen(ptemp, "rb");
@@ -653,6 +666,45 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   fclose(f);
 
   unlink(ptemp);
+  return data;
+}
+
+/*
+ * Given source and target chunks, compute a bsdiff patch between them
+ * (or fetch it from the patch cache, when one is in use).  Return the
+ * patch data, placing its length in *size.  Return NULL on failure.
+ */
+unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
+  if (tgt->type == CHUNK_NORMAL) {
+    if (tgt->len <= 160) {
+      tgt->type = CHUNK_RAW;
+      *size = tgt->len;
+      return tgt->data;
+    }
+  }
+
+  unsigned char* data = NULL;
+  size_t patch_size;
+  if (CacheEnabled()) {
+    data = CacheFindPatch(ChunkSha1(src), ChunkSha1(tgt), &patch_size);
+  }
+  if (data == NULL) {
+    data = RunBsdiff(src, tgt, &patch_size);
+    if (data == NULL) return NULL;
+    if (CacheEnabled()) {
+      CacheStorePatch(ChunkSha1(src), ChunkSha1(tgt), data, patch_size);
+    }
+  }
+
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= patch_size) {
+    free(data);
+
+    tgt->type = CHUNK_RAW;
+    *size = tgt->len;
+    return tgt->data;
+  }
+
+  *size = patch_size;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -779,8 +831,168 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
+typedef struct {
+  int num_jobs;
+  int next_job;
+  pthread_mutex_t lock;
+  void (*fn)(int, void*);
+  void* cookie;
+} JobQueue;
+
+static void* JobWorker(void* cookie) {
+  JobQueue* q = (JobQueue*)cookie;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next_job++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->num_jobs) break;
+
+    q->fn(i, q->cookie);
+  }
+  return NULL;
+}
+
+/*
+ * Call fn(i, cookie) for each i in [0, num_jobs), using up to
+ * num_threads threads.  Jobs are handed out in order, but may finish
+ * in any order.
+ */
+void RunJobs(int num_jobs, int num_threads,
+             void (*fn)(int, void*), void* cookie) {
+  int i;
+
+  if (num_threads > num_jobs) num_threads = num_jobs;
+  if (num_threads <= 1) {
+    for (i = 0; i < num_jobs; ++i) {
+      fn(i, cookie);
+    }
+    return;
+  }
+
+  JobQueue q;
+  q.num_jobs = num_jobs;
+  q.next_job = 0;
+  q.fn = fn;
+  q.cookie = cookie;
+  pthread_mutex_init(&q.lock, NULL);
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  for (i = 0; i < num_threads; ++i) {
+    pthread_create(threads+i, NULL, JobWorker, &q);
+  }
+  for (i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+}
+
+/*
+ * One ReconstructDeflateChunk() call on a target chunk.
+ */
+typedef struct {
+  ImageChunk* chunk;
+  int status;
+} DeflateJob;
+
+static void ReconstructDeflateJob(int i, void* cookie) {
+  DeflateJob* job = (DeflateJob*)cookie + i;
+  job->status = ReconstructDeflateChunk(job->chunk);
+}
+
+/*
+ * One MakePatch() call: the target chunk, the source chunk it is
+ * diffed against, and (once the job has run) the resulting patch.
+ */
+typedef struct {
+  ImageChunk* src;
+  ImageChunk* tgt;
+  unsigned char* patch_data;
+  size_t patch_size;
+} PatchJob;
+
+static void MakePatchJob(int i, void* cookie) {
+  PatchJob* job = (PatchJob*)cookie + i;
+  job->patch_data = MakePatch(job->src, job->tgt, &job->patch_size);
+}
+
+static int chunkptr_compare(const void* a, const void* b) {
+  const ImageChunk* ca = *(ImageChunk* const*)a;
+  const ImageChunk* cb = *(ImageChunk* const*)b;
+  return (ca > cb) - (ca < cb);
+}
+
+/*
+ * Run all the jobs, using up to num_threads threads.  Each job only
+ * writes to its own target chunk and PatchJob, and the results are
+ * left in the job array in order, so the patch file assembled from
+ * them is identical no matter how many threads were used.
+ */
+void MakePatches(PatchJob* jobs, int num_jobs, int num_threads) {
+  int i;
+
+  for (i = 0; i < num_jobs; ++i) {
+    jobs[i].src->have_sha1 = 0;
+    jobs[i].tgt->have_sha1 = 0;
+  }
+
+  if (num_threads <= 1) {
+    RunJobs(num_jobs, 1, MakePatchJob, jobs);
+    return;
+  }
+
+  // bsdiff() builds the suffix array of its source lazily and caches
+  // it in the chunk, as is the source's SHA-1.  Sources used by more
+  // than one job (eg, the whole-file pseudo chunk in zip mode) get
+  // both computed here, so the workers only ever read them.
+  ImageChunk** srcs = malloc(num_jobs * sizeof(ImageChunk*));
+  for (i = 0; i < num_jobs; ++i) {
+    srcs[i] = jobs[i].src;
+  }
+  qsort(srcs, num_jobs, sizeof(ImageChunk*), chunkptr_compare);
+  for (i = 1; i < num_jobs; ++i) {
+    if (srcs[i] == srcs[i-1]) {
+      if (CacheEnabled()) ChunkSha1(srcs[i]);
+      SortSourceChunk(srcs[i]);
+    }
+  }
+  free(srcs);
+
+  RunJobs(num_jobs, num_threads, MakePatchJob, jobs);
+}
+
 int main(int argc, char** argv) {
   int zip_mode = 0;
+  int num_threads = 1;
+
+  if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+    num_threads = atoi(argv[2]);
+    if (num_threads == 0) {
+      num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads < 1) {
+      printf("bad thread count \"%s\"\n", argv[2]);
+      return 2;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+    const char* cache_dir = argv[2];
+    long long cache_max_mb = 4096;
+    argc -= 2;
+    argv += 2;
+
+    if (argc >= 3 && strcmp(argv[1], "-m") == 0) {
+      cache_max_mb = atoll(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    if (CacheInit(cache_dir, cache_max_mb << 20) != 0) {
+      return 1;
+    }
+  }
 
   if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
     zip_mode = 1;
@@ -815,7 +1027,8 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-j <threads>] [-c <cache-dir> [-m <cache-max-mb>]] "
+           "[-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -876,33 +1089,39 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Find the target deflate chunks that need their encoder parameters
+  // reconstructed.  If two deflate chunks are identical (eg, the
+  // kernel has not changed between two builds), treat them as normal
+  // chunks.  This makes applypatch much faster -- it can apply a
+  // trivial patch to the compressed data, rather than uncompressing
+  // and recompressing to apply the trivial patch to the uncompressed
+  // data.  Target chunks with no source are treated as normal too, so
+  // neither kind is worth reconstructing.
+  DeflateJob* deflate_jobs = malloc(num_tgt_chunks * sizeof(DeflateJob));
+  int num_deflate_jobs = 0;
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
-      // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
-        printf("failed to reconstruct target deflate chunk %d [%s]; "
-               "treating as normal\n", i, tgt_chunks[i].filename);
-        ChangeDeflateChunkToNormal(tgt_chunks+i);
-        if (zip_mode) {
-          ImageChunk* src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
-          if (src) {
-            ChangeDeflateChunkToNormal(src);
-          }
-        } else {
-          ChangeDeflateChunkToNormal(src_chunks+i);
-        }
-        continue;
+      ImageChunk* src;
+      if (zip_mode) {
+        src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
+      } else {
+        src = src_chunks+i;
       }
+      if (src != NULL && !AreChunksEqual(tgt_chunks+i, src)) {
+        deflate_jobs[num_deflate_jobs].chunk = tgt_chunks+i;
+        deflate_jobs[num_deflate_jobs].status = 0;
+        ++num_deflate_jobs;
+      }
+    }
+  }
+
+  // Each chunk is reconstructed independently, so the chosen
+  // parameters don't depend on the thread count.
+  RunJobs(num_deflate_jobs, num_threads, ReconstructDeflateJob, deflate_jobs);
 
-      // If two deflate chunks are identical (eg, the kernel has not
-      // changed between two builds), treat them as normal chunks.
-      // This makes applypatch much faster -- it can apply a trivial
-      // patch to the compressed data, rather than uncompressing and
-      // recompressing to apply the trivial patch to the uncompressed
-      // data.
+  int j = 0;
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (tgt_chunks[i].type == CHUNK_DEFLATE) {
       ImageChunk* src;
       if (zip_mode) {
         src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
@@ -910,14 +1129,24 @@ int main(int argc, char** argv) {
         src = src_chunks+i;
       }
 
-      if (src == NULL || AreChunksEqual(tgt_chunks+i, src)) {
-        ChangeDeflateChunkToNormal(tgt_chunks+i);
-        if (src) {
-          ChangeDeflateChunkToNormal(src);
-        }
+      // Keep the chunk as a deflate chunk only if we confirmed that
+      // given the uncompressed chunk data in the target, we can
+      // recompress it and get exactly the same bits as are in the
+      // input target image.  Otherwise treat it (and its source) as a
+      // normal non-deflated chunk.
+      if (j < num_deflate_jobs && deflate_jobs[j].chunk == tgt_chunks+i) {
+        if (deflate_jobs[j++].status == 0) continue;
+        printf("failed to reconstruct target deflate chunk %d [%s]; "
+               "treating as normal\n", i, tgt_chunks[i].filename);
+      }
+
+      ChangeDeflateChunkToNormal(tgt_chunks+i);
+      if (src) {
+        ChangeDeflateChunkToNormal(src);
       }
     }
   }
+  free(deflate_jobs);
 
   // Merging neighboring normal chunks.
   if (zip_mode) {
@@ -944,17 +1173,17 @@ int main(int argc, char** argv) {
   DumpChunks(src_chunks, num_src_chunks);
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    jobs[i].tgt = tgt_chunks+i;
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,11 +1193,21 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      jobs[i].src = src_chunks+i;
     }
+  }
+
+  MakePatches(jobs, num_tgt_chunks, num_threads);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    patch_data[i] = jobs[i].patch_data;
+    patch_size[i] = jobs[i].patch_size;
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  free(jobs);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
@@ -1047,5 +1286,7 @@ int main(int argc, char** argv) {
 
   fclose(f);
 
+  CacheTrim();
+
   return 0;
 }
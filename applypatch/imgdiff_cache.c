@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The cache directory holds two kinds of files:
+ *
+ *   patch-<source sha1>-<target sha1>   the bsdiff patch between the two
+ *   sa-<source sha1>                    the suffix array of the source
+ *
+ * Each entry is followed by the SHA-1 of its contents, which is
+ * checked when it is read; an entry that doesn't match is deleted and
+ * treated as a miss.  Entries are written to a temporary file and
+ * renamed into place, so concurrent imgdiff processes never see a
+ * partial entry.  Each hit bumps the entry's mtime; CacheTrim()
+ * deletes the entries with the oldest mtimes first, and temporary
+ * files left behind by imgdiff processes that died.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "imgdiff_cache.h"
+
+// Temporary files older than this are assumed to be abandoned.
+#define STALE_TEMP_AGE (24 * 60 * 60)
+
+static char* cache_dir = NULL;
+static long long cache_max_size = 0;
+
+int CacheInit(const char* dir, long long max_size) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("failed to create cache dir %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  cache_dir = strdup(dir);
+  cache_max_size = max_size;
+  return 0;
+}
+
+int CacheEnabled() {
+  return cache_dir != NULL;
+}
+
+void CacheDigest(const unsigned char* data, size_t len,
+                 uint8_t digest[SHA_DIGEST_SIZE]) {
+  SHA_CTX ctx;
+  SHA_init(&ctx);
+  // SHA_update() takes an int length; feed big chunks in pieces.
+  while (len > 0) {
+    int n = len > (1 << 30) ? (1 << 30) : len;
+    SHA_update(&ctx, data, n);
+    data += n;
+    len -= n;
+  }
+  memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
+
+static void HexDigest(const uint8_t digest[SHA_DIGEST_SIZE], char* out) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+  for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+    *out++ = hex[digest[i] >> 4];
+    *out++ = hex[digest[i] & 0xf];
+  }
+  *out = '\0';
+}
+
+static char* EntryPath(const char* prefix,
+                       const uint8_t* sha1_a, const uint8_t* sha1_b) {
+  char a[SHA_DIGEST_SIZE*2+1];
+  char b[SHA_DIGEST_SIZE*2+1];
+  HexDigest(sha1_a, a);
+  size_t len = strlen(cache_dir) + strlen(prefix) + sizeof(a) * 2 + 4;
+  char* path = malloc(len);
+  if (sha1_b) {
+    HexDigest(sha1_b, b);
+    snprintf(path, len, "%s/%s-%s-%s", cache_dir, prefix, a, b);
+  } else {
+    snprintf(path, len, "%s/%s-%s", cache_dir, prefix, a);
+  }
+  return path;
+}
+
+// Read the whole entry at path into a malloc'd buffer, and mark it as
+// recently used.  Return NULL if it doesn't exist (or isn't
+// expected_size bytes long, when expected_size is nonzero).  An entry
+// whose checksum doesn't match is deleted.
+static unsigned char* ReadEntry(const char* path, size_t expected_size,
+                                size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < SHA_DIGEST_SIZE ||
+      (expected_size != 0 &&
+       (size_t)st.st_size != expected_size + SHA_DIGEST_SIZE)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t file_size = st.st_size;
+  unsigned char* data = malloc(file_size);
+  if (data == NULL) {
+    close(fd);
+    return NULL;
+  }
+  size_t pos = 0;
+  while (pos < file_size) {
+    ssize_t r = read(fd, data+pos, file_size-pos);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      free(data);
+      close(fd);
+      return NULL;
+    }
+    pos += r;
+  }
+  close(fd);
+
+  size_t data_size = file_size - SHA_DIGEST_SIZE;
+  uint8_t digest[SHA_DIGEST_SIZE];
+  CacheDigest(data, data_size, digest);
+  if (memcmp(digest, data + data_size, SHA_DIGEST_SIZE) != 0) {
+    printf("cache entry %s is corrupt; deleting it\n", path);
+    unlink(path);
+    free(data);
+    return NULL;
+  }
+
+  utime(path, NULL);
+  *size = data_size;
+  return data;
+}
+
+static int WriteAll(int fd, const unsigned char* data, size_t size) {
+  size_t pos = 0;
+  while (pos < size) {
+    ssize_t w = write(fd, data+pos, size-pos);
+    if (w <= 0) {
+      if (w < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    pos += w;
+  }
+  return 0;
+}
+
+static void WriteEntry(const char* path,
+                       const unsigned char* data, size_t size) {
+  size_t len = strlen(cache_dir) + 16;
+  char* temp = malloc(len);
+  snprintf(temp, len, "%s/tmp-XXXXXX", cache_dir);
+  int fd = mkstemp(temp);
+  if (fd < 0) {
+    printf("failed to create cache entry in %s: %s\n",
+           cache_dir, strerror(errno));
+    free(temp);
+    return;
+  }
+
+  uint8_t digest[SHA_DIGEST_SIZE];
+  CacheDigest(data, size, digest);
+  if (WriteAll(fd, data, size) != 0 ||
+      WriteAll(fd, digest, SHA_DIGEST_SIZE) != 0) {
+    printf("failed to write cache entry %s: %s\n", temp, strerror(errno));
+    close(fd);
+    unlink(temp);
+    free(temp);
+    return;
+  }
+  fchmod(fd, 0644);
+  if (close(fd) != 0 || rename(temp, path) != 0) {
+    printf("failed to store cache entry %s: %s\n", path, strerror(errno));
+    unlink(temp);
+  }
+  free(temp);
+}
+
+unsigned char* CacheFindPatch(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                              const uint8_t tgt_sha1[SHA_DIGEST_SIZE],
+                              size_t* size) {
+  if (!CacheEnabled()) return NULL;
+  char* path = EntryPath("patch", src_sha1, tgt_sha1);
+  unsigned char* data = ReadEntry(path, 0, size);
+  free(path);
+  return data;
+}
+
+void CacheStorePatch(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                     const uint8_t tgt_sha1[SHA_DIGEST_SIZE],
+                     const unsigned char* data, size_t size) {
+  if (!CacheEnabled()) return;
+  char* path = EntryPath("patch", src_sha1, tgt_sha1);
+  WriteEntry(path, data, size);
+  free(path);
+}
+
+off_t* CacheFindSuffixArray(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                            off_t len) {
+  if (!CacheEnabled()) return NULL;
+  char* path = EntryPath("sa", src_sha1, NULL);
+  size_t size;
+  off_t* I = (off_t*)ReadEntry(path, (len+1) * sizeof(off_t), &size);
+  free(path);
+  return I;
+}
+
+void CacheStoreSuffixArray(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                           const off_t* I, off_t len) {
+  if (!CacheEnabled()) return;
+  char* path = EntryPath("sa", src_sha1, NULL);
+  WriteEntry(path, (const unsigned char*)I, (len+1) * sizeof(off_t));
+  free(path);
+}
+
+typedef struct {
+  char* path;
+  long long size;
+  time_t mtime;
+} CacheEntry;
+
+static int entry_mtime_compare(const void* a, const void* b) {
+  time_t ta = ((const CacheEntry*)a)->mtime;
+  time_t tb = ((const CacheEntry*)b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+void CacheTrim() {
+  if (!CacheEnabled()) return;
+
+  DIR* d = opendir(cache_dir);
+  if (d == NULL) {
+    printf("failed to open cache dir %s: %s\n", cache_dir, strerror(errno));
+    return;
+  }
+
+  int num_entries = 0;
+  int alloc_entries = 64;
+  CacheEntry* entries = malloc(alloc_entries * sizeof(CacheEntry));
+  long long total = 0;
+  time_t now = time(NULL);
+
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    int temp = strncmp(de->d_name, "tmp-", 4) == 0;
+    if (!temp &&
+        strncmp(de->d_name, "patch-", 6) != 0 &&
+        strncmp(de->d_name, "sa-", 3) != 0) {
+      continue;
+    }
+
+    size_t len = strlen(cache_dir) + strlen(de->d_name) + 2;
+    char* path = malloc(len);
+    snprintf(path, len, "%s/%s", cache_dir, de->d_name);
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+      free(path);
+      continue;
+    }
+
+    // Another imgdiff may still be writing a recent temporary file.
+    if (temp) {
+      if (now - st.st_mtime > STALE_TEMP_AGE) {
+        unlink(path);
+      }
+      free(path);
+      continue;
+    }
+
+    if (num_entries == alloc_entries) {
+      alloc_entries *= 2;
+      entries = realloc(entries, alloc_entries * sizeof(CacheEntry));
+    }
+    entries[num_entries].path = path;
+    entries[num_entries].size = st.st_size;
+    entries[num_entries].mtime = st.st_mtime;
+    ++num_entries;
+    total += st.st_size;
+  }
+  closedir(d);
+
+  qsort(entries, num_entries, sizeof(CacheEntry), entry_mtime_compare);
+
+  int i;
+  for (i = 0; i < num_entries; ++i) {
+    if (total > cache_max_size) {
+      if (unlink(entries[i].path) == 0) {
+        total -= entries[i].size;
+      }
+    }
+    free(entries[i].path);
+  }
+  free(entries);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_IMGDIFF_CACHE_H
+#define _BUILD_TOOLS_APPLYPATCH_IMGDIFF_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mincrypt/sha.h"
+
+// An on-disk cache of chunk patches for imgdiff, keyed by the SHA-1
+// of the source and target chunk data.  Suffix arrays of source
+// chunks are cached too (keyed by the source SHA-1 alone), so that a
+// changed target can still skip the qsufsort() step.  All functions
+// are safe to call from several threads, and several imgdiff
+// processes may share one cache directory.
+
+// Start using 'dir' as the cache, creating it if necessary.  The
+// cache is trimmed to at most max_size bytes by CacheTrim().  Returns
+// 0 on success.
+int CacheInit(const char* dir, long long max_size);
+
+// Return nonzero if CacheInit() has succeeded.
+int CacheEnabled();
+
+// Compute the SHA-1 of len bytes at data.
+void CacheDigest(const unsigned char* data, size_t len,
+                 uint8_t digest[SHA_DIGEST_SIZE]);
+
+// Return a malloc'd copy of the patch previously stored for this
+// pair of chunks (setting *size), or NULL if there isn't one.
+unsigned char* CacheFindPatch(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                              const uint8_t tgt_sha1[SHA_DIGEST_SIZE],
+                              size_t* size);
+void CacheStorePatch(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                     const uint8_t tgt_sha1[SHA_DIGEST_SIZE],
+                     const unsigned char* data, size_t size);
+
+// Return a malloc'd suffix array (of len+1 entries, as built by
+// bsdiff) for source data of length len, or NULL if there isn't one.
+off_t* CacheFindSuffixArray(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                            off_t len);
+void CacheStoreSuffixArray(const uint8_t src_sha1[SHA_DIGEST_SIZE],
+                           const off_t* I, off_t len);
+
+// Delete the least recently used entries until the cache is no
+// bigger than the max_size given to CacheInit().
+void CacheTrim();
+
+#endif  // _BUILD_TOOLS_APPLYPATCH_IMGDIFF_CACHE_H
@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "applypatch.h"
@@ -155,6 +157,201 @@ int PatchMode(int argc, char** argv) {
     return result;
 }
 
+typedef struct {
+    int line;
+    int argc;
+    char** argv;
+} BatchRecord;
+
+// Return the largest size the given patch source can have (for a
+// partition, the largest of the sizes listed in its name), or 0 if
+// it can't be determined.
+static size_t BatchSourceSize(const char* source_filename) {
+    if (strncmp(source_filename, "MTD:", 4) == 0 ||
+        strncmp(source_filename, "EMMC:", 5) == 0) {
+        return LargestPartitionSize(source_filename);
+    }
+
+    struct stat st;
+    if (stat(source_filename, &st) != 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+// Work out the most room any patch record in the batch will need on
+// /cache for backing up its source (which applypatch() does when the
+// target is a partition, or when the target filesystem is short of
+// space), and free that much once before the batch starts rather
+// than record by record.
+static void PlanBatchCacheSpace(BatchRecord* records, int num_records) {
+    size_t needed = 0;
+    int i;
+    for (i = 0; i < num_records; ++i) {
+        int argc = records[i].argc;
+        char** argv = records[i].argv;
+        if (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-s") == 0) {
+            continue;
+        }
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+            argc -= 2;
+            argv += 2;
+        }
+        if (argc < 6) continue;
+
+        const char* source_filename = argv[1];
+        const char* target_filename = argv[2];
+        if (strcmp(target_filename, "-") == 0) {
+            target_filename = source_filename;
+        }
+        size_t target_size = strtoul(argv[4], NULL, 10);
+
+        int backup = 1;
+        if (strncmp(target_filename, "MTD:", 4) != 0 &&
+            strncmp(target_filename, "EMMC:", 5) != 0) {
+            // Same test as applypatch() makes against the top-level
+            // directory of the target.
+            char target_fs[strlen(target_filename)+1];
+            strcpy(target_fs, target_filename);
+            char* slash = strchr(target_fs+1, '/');
+            if (slash != NULL) *slash = '\0';
+
+            size_t free_space = FreeSpaceForFile(target_fs);
+            backup = free_space == (size_t)-1 ||
+                free_space <= MIN_TARGET_FREE ||
+                free_space <= target_size * 3 / 2;
+        }
+
+        if (backup) {
+            size_t size = BatchSourceSize(source_filename);
+            if (size > needed) needed = size;
+        }
+    }
+
+    if (needed > 0) {
+        printf("batch needs up to %ld bytes on /cache\n", (long)needed);
+        if (MakeFreeSpaceOnCache(needed) < 0) {
+            printf("warning: unable to make %ld bytes available on /cache\n",
+                   (long)needed);
+        }
+    }
+}
+
+// Run every record of a manifest file (or stdin, for "-") in this one
+// process.  Each non-empty line of the manifest holds the arguments
+// of one invocation, exactly as they would be given on the command
+// line:
+//
+//   [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> <tgt-size> [<src-sha1>:<patch> ...]
+//   -c <file> [<sha1> ...]
+//   -s <bytes>
+//
+// Lines starting with '#' are ignored.  Records run in order, and the
+// batch stops at the first one that fails, returning its status.
+// Running them in one process means MTD partitions are scanned only
+// once, and /cache space is planned for the whole batch up front.
+int BatchMode(int argc, char** argv) {
+    if (argc != 3) {
+        return 2;
+    }
+
+    FileContents manifest;
+    if (strcmp(argv[2], "-") == 0) {
+        size_t alloc = 4096;
+        size_t size = 0;
+        manifest.data = malloc(alloc);
+        size_t read;
+        while ((read = fread(manifest.data + size, 1,
+                             alloc - size, stdin)) > 0) {
+            size += read;
+            if (size == alloc) {
+                alloc *= 2;
+                manifest.data = realloc(manifest.data, alloc);
+            }
+        }
+        manifest.size = size;
+    } else if (LoadFileContents(argv[2], &manifest, RETOUCH_DONT_MASK) != 0) {
+        printf("failed to load manifest %s\n", argv[2]);
+        return 1;
+    }
+    manifest.data = realloc(manifest.data, manifest.size + 1);
+    manifest.data[manifest.size] = '\0';
+
+    int num_records = 0;
+    int alloc_records = 64;
+    BatchRecord* records = malloc(alloc_records * sizeof(BatchRecord));
+
+    char* line = (char*)manifest.data;
+    int line_number = 0;
+    while (line != NULL) {
+        ++line_number;
+        char* next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+
+        // Split the line into words, in place.  argv[0] is the
+        // program name, as the *Mode() functions expect.
+        int words = 0;
+        int alloc_words = 8;
+        char** words_argv = malloc(alloc_words * sizeof(char*));
+        words_argv[words++] = argv[0];
+        char* p = line;
+        for (;;) {
+            while (*p && isspace((unsigned char)*p)) ++p;
+            if (*p == '\0' || (words == 1 && *p == '#')) break;
+            if (words == alloc_words) {
+                alloc_words *= 2;
+                words_argv = realloc(words_argv, alloc_words * sizeof(char*));
+            }
+            words_argv[words++] = p;
+            while (*p && !isspace((unsigned char)*p)) ++p;
+            if (*p) *p++ = '\0';
+        }
+
+        if (words > 1) {
+            if (num_records == alloc_records) {
+                alloc_records *= 2;
+                records = realloc(records, alloc_records * sizeof(BatchRecord));
+            }
+            records[num_records].line = line_number;
+            records[num_records].argc = words;
+            records[num_records].argv = words_argv;
+            ++num_records;
+        } else {
+            free(words_argv);
+        }
+        line = next;
+    }
+
+    PlanBatchCacheSpace(records, num_records);
+
+    int result = 0;
+    int i;
+    for (i = 0; i < num_records; ++i) {
+        char** rargv = records[i].argv;
+        int rargc = records[i].argc;
+        if (result == 0) {
+            if (strcmp(rargv[1], "-c") == 0) {
+                result = CheckMode(rargc, rargv);
+            } else if (strcmp(rargv[1], "-s") == 0) {
+                result = SpaceMode(rargc, rargv);
+            } else {
+                result = PatchMode(rargc, rargv);
+            }
+            if (result == 2) {
+                printf("bad record at line %d of manifest\n", records[i].line);
+                result = 1;
+            } else if (result != 0) {
+                printf("record at line %d of manifest failed\n", records[i].line);
+            }
+        }
+        free(rargv);
+    }
+    free(records);
+    free(manifest.data);
+
+    return result;
+}
+
 // This program applies binary patches to files in a way that is safe
 // (the original file is not touched until we have the desired
 // replacement for it) and idempotent (it's okay to run this program
@@ -186,12 +383,15 @@ int main(int argc, char** argv) {
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
             "   or  %s -s <bytes>\n"
+            "   or  %s -m <manifest-file>\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  MTD:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
-            "to specify reading from or writing to an MTD partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            "to specify reading from or writing to an MTD partition.\n\n"
+            "A manifest holds one set of arguments per line, in any of\n"
+            "the first three forms; \"-\" reads the manifest from stdin.\n\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -203,6 +403,8 @@ int main(int argc, char** argv) {
         result = CheckMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
         result = SpaceMode(argc, argv);
+    } else if (strncmp(argv[1], "-m", 3) == 0) {
+        result = BatchMode(argc, argv);
     } else {
         result = PatchMode(argc, argv);
     }
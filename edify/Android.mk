@@ -5,7 +5,8 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	compile.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -23,6 +24,7 @@ LOCAL_SRC_FILES := \
 LOCAL_CFLAGS := $(edify_cflags) -g -O0
 LOCAL_MODULE := edify
 LOCAL_YACCFLAGS := -v
+LOCAL_LDLIBS += -lpthread
 
 include $(BUILD_HOST_EXECUTABLE)
 
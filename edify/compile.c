@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Lowering of the tree built by the parser into the form that gets
+// evaluated.  The parser makes a separate allocation for every node,
+// argument list and string, and a script of n statements becomes a
+// chain of n nested sequence nodes.  CompileExpr() rewrites that into
+// a flat program:
+//
+//   - chains of ';' become a single sequence node with one argument
+//     per statement, which SequenceFn() evaluates in a loop;
+//
+//   - builtin operators whose operands are all literals (+, ==, !=,
+//     !, &&, ||, if/ifelse, is_substring, concat) are evaluated now,
+//     and statements that are just literals are dropped;
+//
+//   - the argument counts of builtins are checked;
+//
+//   - all nodes, argument lists and strings are packed into three
+//     arrays, with each distinct string stored once.
+//
+// Functions still get Expr nodes and evaluate their arguments
+// themselves, so anything registered with RegisterFunction() works
+// unchanged.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+static const char* kOperatorName = "(operator)";
+
+static bool IsLiteral(const Expr* e) {
+    return e->fn == Literal;
+}
+
+static bool IsOperator(const Expr* e) {
+    return !IsLiteral(e) && strcmp(e->name, kOperatorName) == 0;
+}
+
+// Free a tree made by the parser (or partly rewritten by Fold()).
+static void FreeTree(Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeTree(e->argv[i]);
+    }
+    free(e->argv);
+    if (!IsOperator(e)) {
+        free(e->name);
+    }
+    free(e);
+}
+
+// Turn e into the literal str (which it takes ownership of).
+static Expr* ReplaceWithLiteral(Expr* e, char* str) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeTree(e->argv[i]);
+    }
+    free(e->argv);
+    if (!IsOperator(e)) {
+        free(e->name);
+    }
+    e->fn = Literal;
+    e->name = str;
+    e->argc = 0;
+    e->argv = NULL;
+    return e;
+}
+
+static Expr* ReplaceWithBoolean(Expr* e, bool b) {
+    return ReplaceWithLiteral(e, strdup(b ? "t" : ""));
+}
+
+// Replace e with its argument 'keep', freeing everything else.  The
+// replacement takes over e's place in the script, so that assert()
+// still quotes the original text.
+static Expr* ReplaceWithArg(Expr* e, int keep) {
+    Expr* result = e->argv[keep];
+    e->argv[keep] = NULL;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (e->argv[i] != NULL) FreeTree(e->argv[i]);
+    }
+    e->argc = 0;
+    result->start = e->start;
+    result->end = e->end;
+    FreeTree(e);
+    return result;
+}
+
+static bool AllLiterals(const Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (!IsLiteral(e->argv[i])) return false;
+    }
+    return true;
+}
+
+static int LineOf(const char* script, int pos) {
+    int line = 1;
+    int i;
+    for (i = 0; i < pos && script[i] != '\0'; ++i) {
+        if (script[i] == '\n') ++line;
+    }
+    return line;
+}
+
+// A bad arg count is only an error for the functions that would
+// reject it when called; the rest (which ignore extra args) just get
+// a warning, since the call may be in a branch that never runs.
+static const struct {
+    const char* name;
+    int min_args;
+    int max_args;
+    bool fatal;
+} kBuiltinArgs[] = {
+    { "abort", 0, 1, false },
+    { "greater_than_int", 2, 2, true },
+    { "ifelse", 2, 3, true },
+    { "is_substring", 2, 2, false },
+    { "less_than_int", 2, 2, true },
+    { "sleep", 1, 1, false },
+};
+
+static void CheckArgCount(const Expr* e, const char* script,
+                          int* error_count) {
+    if (IsLiteral(e) || IsOperator(e)) return;
+    size_t i;
+    for (i = 0; i < sizeof(kBuiltinArgs) / sizeof(kBuiltinArgs[0]); ++i) {
+        if (strcmp(e->name, kBuiltinArgs[i].name) != 0) continue;
+        if (e->argc < kBuiltinArgs[i].min_args ||
+            e->argc > kBuiltinArgs[i].max_args) {
+            printf("line %d: %s%s() expects %d to %d args, got %d\n",
+                   LineOf(script, e->start),
+                   kBuiltinArgs[i].fatal ? "" : "warning: ", e->name,
+                   kBuiltinArgs[i].min_args, kBuiltinArgs[i].max_args,
+                   e->argc);
+            if (kBuiltinArgs[i].fatal) ++*error_count;
+        }
+        return;
+    }
+}
+
+static Expr* Fold(Expr* e, const char* script, int* error_count);
+
+// Flatten the chain of binary sequence nodes rooted at e (which the
+// parser builds left-deep) into one node, folding each statement and
+// dropping the ones that are literals, other than the last.
+static Expr* FoldSequence(Expr* e, const char* script, int* error_count) {
+    int count = 0;
+    Expr* p;
+    for (p = e; p->fn == SequenceFn && p->argc == 2; p = p->argv[0]) {
+        ++count;
+    }
+    ++count;
+
+    // Unlink the statements, last first, freeing the chain as we go.
+    Expr** statements = malloc(count * sizeof(Expr*));
+    int i = count;
+    p = e->argv[0];
+    statements[--i] = e->argv[1];
+    free(e->argv);
+    while (p->fn == SequenceFn && p->argc == 2) {
+        Expr* next = p->argv[0];
+        statements[--i] = p->argv[1];
+        free(p->argv);
+        free(p);
+        p = next;
+    }
+    statements[--i] = p;
+
+    int kept = 0;
+    int alloc = count;
+    Expr** argv = malloc(alloc * sizeof(Expr*));
+    for (i = 0; i < count; ++i) {
+        Expr* s = Fold(statements[i], script, error_count);
+        bool last = (i == count-1);
+        if (s->fn == SequenceFn && !last) {
+            // A parenthesized sequence as a statement; splice it in.
+            alloc += s->argc;
+            argv = realloc(argv, alloc * sizeof(Expr*));
+            int j;
+            for (j = 0; j < s->argc; ++j) {
+                if (IsLiteral(s->argv[j])) {
+                    FreeTree(s->argv[j]);
+                } else {
+                    argv[kept++] = s->argv[j];
+                }
+            }
+            s->argc = 0;
+            FreeTree(s);
+        } else if (IsLiteral(s) && !last) {
+            FreeTree(s);
+        } else {
+            argv[kept++] = s;
+        }
+    }
+    free(statements);
+
+    if (kept == 1) {
+        Expr* only = argv[0];
+        free(argv);
+        e->argc = 0;
+        e->argv = NULL;
+        free(e);
+        return only;
+    }
+    e->argc = kept;
+    e->argv = argv;
+    return e;
+}
+
+static Expr* Fold(Expr* e, const char* script, int* error_count) {
+    if (IsLiteral(e)) return e;
+    if (e->fn == SequenceFn && e->argc == 2) {
+        return FoldSequence(e, script, error_count);
+    }
+
+    CheckArgCount(e, script, error_count);
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        e->argv[i] = Fold(e->argv[i], script, error_count);
+    }
+
+    if (e->fn == ConcatFn && AllLiterals(e)) {
+        size_t length = 0;
+        for (i = 0; i < e->argc; ++i) {
+            length += strlen(e->argv[i]->name);
+        }
+        char* result = malloc(length+1);
+        result[0] = '\0';
+        char* p = result;
+        for (i = 0; i < e->argc; ++i) {
+            strcpy(p, e->argv[i]->name);
+            p += strlen(p);
+        }
+        return ReplaceWithLiteral(e, result);
+    }
+
+    if ((e->fn == EqualityFn || e->fn == InequalityFn) &&
+        e->argc == 2 && AllLiterals(e)) {
+        bool equal = strcmp(e->argv[0]->name, e->argv[1]->name) == 0;
+        return ReplaceWithBoolean(e, equal == (e->fn == EqualityFn));
+    }
+
+    if (e->fn == SubstringFn && e->argc == 2 && AllLiterals(e)) {
+        return ReplaceWithBoolean(
+            e, strstr(e->argv[1]->name, e->argv[0]->name) != NULL);
+    }
+
+    if (e->fn == LogicalNotFn && e->argc == 1 && AllLiterals(e)) {
+        return ReplaceWithBoolean(e, e->argv[0]->name[0] == '\0');
+    }
+
+    if ((e->fn == LogicalAndFn || e->fn == LogicalOrFn) &&
+        e->argc == 2 && IsLiteral(e->argv[0])) {
+        bool left = e->argv[0]->name[0] != '\0';
+        bool take_right = (e->fn == LogicalAndFn) ? left : !left;
+        return ReplaceWithArg(e, take_right ? 1 : 0);
+    }
+
+    if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3) &&
+        IsLiteral(e->argv[0])) {
+        if (e->argv[0]->name[0] != '\0') {
+            return ReplaceWithArg(e, 1);
+        }
+        // A false condition with no else branch is the value of the
+        // ifelse, as in IfElseFn().
+        return ReplaceWithArg(e, e->argc == 3 ? 2 : 0);
+    }
+
+    return e;
+}
+
+typedef struct {
+    Expr* nodes;
+    int node_count;
+    Expr** args;
+    int arg_count;
+
+    char* strings;
+    size_t strings_used;
+    // Open-addressed hash table of the offsets of the strings in
+    // 'strings', plus one (zero marks an empty slot).
+    size_t* table;
+    size_t table_size;
+} Program;
+
+static void CountTree(const Expr* e, int* nodes, int* args, size_t* chars) {
+    ++*nodes;
+    *args += e->argc;
+    *chars += strlen(e->name) + 1;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        CountTree(e->argv[i], nodes, args, chars);
+    }
+}
+
+static char* Intern(Program* prog, const char* s) {
+    size_t h = 5381;
+    const unsigned char* p;
+    for (p = (const unsigned char*)s; *p; ++p) {
+        h = h * 33 + *p;
+    }
+    size_t slot = h % prog->table_size;
+    while (prog->table[slot] != 0) {
+        char* candidate = prog->strings + prog->table[slot] - 1;
+        if (strcmp(candidate, s) == 0) {
+            return candidate;
+        }
+        slot = (slot + 1) % prog->table_size;
+    }
+    size_t len = strlen(s) + 1;
+    char* result = prog->strings + prog->strings_used;
+    memcpy(result, s, len);
+    prog->table[slot] = prog->strings_used + 1;
+    prog->strings_used += len;
+    return result;
+}
+
+static Expr* Pack(Program* prog, const Expr* e) {
+    Expr* node = prog->nodes + prog->node_count++;
+    node->fn = e->fn;
+    node->name = Intern(prog, e->name);
+    node->argc = e->argc;
+    node->argv = NULL;
+    node->start = e->start;
+    node->end = e->end;
+    if (e->argc > 0) {
+        node->argv = prog->args + prog->arg_count;
+        prog->arg_count += e->argc;
+        int i;
+        for (i = 0; i < e->argc; ++i) {
+            node->argv[i] = Pack(prog, e->argv[i]);
+        }
+    }
+    return node;
+}
+
+Expr* CompileExpr(Expr* root, const char* script, int* error_count) {
+    root = Fold(root, script, error_count);
+
+    int nodes = 0;
+    int args = 0;
+    size_t chars = 0;
+    CountTree(root, &nodes, &args, &chars);
+
+    Program prog;
+    prog.nodes = malloc(nodes * sizeof(Expr));
+    prog.node_count = 0;
+    prog.args = malloc((args > 0 ? args : 1) * sizeof(Expr*));
+    prog.arg_count = 0;
+    prog.strings = malloc(chars);
+    prog.strings_used = 0;
+    prog.table_size = nodes * 2 + 1;
+    prog.table = calloc(prog.table_size, sizeof(size_t));
+
+    Expr* result = Pack(&prog, root);
+
+    free(prog.table);
+    FreeTree(root);
+    return result;
+}
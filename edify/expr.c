@@ -20,6 +20,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 
 #include "expr.h"
 
@@ -32,8 +36,13 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+static Value* Call(State* state, Expr* expr);
+
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    if (expr->fn == Literal) {
+        return strdup(expr->name);
+    }
+    Value* v = Call(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +55,7 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return Call(state, expr);
 }
 
 Value* StringValue(char* str) {
@@ -58,9 +67,64 @@ Value* StringValue(char* str) {
     return v;
 }
 
+Value* SharedBlobValue(char* data, ssize_t size, ValueStorage* storage) {
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = size;
+    v->data = data;
+    RetainValueStorage(storage);
+    return v;
+}
+
+// Registered storage; there's rarely more than one (the package).
+static ValueStorage* storage_list = NULL;
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void RegisterValueStorage(ValueStorage* storage) {
+    pthread_mutex_lock(&storage_lock);
+    storage->next = storage_list;
+    storage_list = storage;
+    pthread_mutex_unlock(&storage_lock);
+}
+
+ValueStorage* FindValueStorage(const char* data) {
+    if (data == NULL) return NULL;
+    pthread_mutex_lock(&storage_lock);
+    ValueStorage* s;
+    for (s = storage_list; s != NULL; s = s->next) {
+        if (data >= s->base && data < s->base + s->length) break;
+    }
+    pthread_mutex_unlock(&storage_lock);
+    return s;
+}
+
+void RetainValueStorage(ValueStorage* storage) {
+    __sync_fetch_and_add(&storage->refcount, 1);
+}
+
+void ReleaseValueStorage(ValueStorage* storage) {
+    if (__sync_sub_and_fetch(&storage->refcount, 1) == 0) {
+        pthread_mutex_lock(&storage_lock);
+        ValueStorage** p;
+        for (p = &storage_list; *p != NULL; p = &(*p)->next) {
+            if (*p == storage) {
+                *p = storage->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&storage_lock);
+        storage->release(storage);
+    }
+}
+
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
+    ValueStorage* storage = FindValueStorage(v->data);
+    if (storage != NULL) {
+        ReleaseValueStorage(storage);
+    } else {
+        free(v->data);
+    }
     free(v);
 }
 
@@ -68,34 +132,25 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
-    int i;
-    for (i = 0; i < argc; ++i) {
-        strings[i] = NULL;
-    }
-    char* result = NULL;
-    int length = 0;
-    for (i = 0; i < argc; ++i) {
-        strings[i] = Evaluate(state, argv[i]);
-        if (strings[i] == NULL) {
-            goto done;
-        }
-        length += strlen(strings[i]);
+    char** strings = ReadTransientVarArgs(state, argc, argv);
+    if (strings == NULL) {
+        return NULL;
     }
-
-    result = malloc(length+1);
-    int p = 0;
+    size_t* lengths = AllocTransient(argc * sizeof(size_t));
+    size_t length = 0;
+    int i;
     for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+        lengths[i] = strlen(strings[i]);
+        length += lengths[i];
     }
-    result[p] = '\0';
 
-  done:
+    char* result = malloc(length+1);
+    char* p = result;
     for (i = 0; i < argc; ++i) {
-        free(strings[i]);
+        memcpy(p, strings[i], lengths[i]);
+        p += lengths[i];
     }
-    free(strings);
+    *p = '\0';
     return StringValue(result);
 }
 
@@ -105,20 +160,18 @@ Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
         state->errmsg = strdup("ifelse expects 2 or 3 arguments");
         return NULL;
     }
-    char* cond = Evaluate(state, argv[0]);
+    const char* cond = EvaluateTransientString(state, argv[0]);
     if (cond == NULL) {
         return NULL;
     }
 
     if (BooleanString(cond) == true) {
-        free(cond);
         return EvaluateValue(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
             return EvaluateValue(state, argv[2]);
         } else {
-            return StringValue(cond);
+            return StringValue(strdup(cond));
         }
     }
 }
@@ -140,13 +193,11 @@ Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        const char* v = EvaluateTransientString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
-        int b = BooleanString(v);
-        free(v);
-        if (!b) {
+        if (!BooleanString(v)) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
             char* err_src = malloc(len + 20);
@@ -163,112 +214,99 @@ Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 Value* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    const char* val = EvaluateTransientString(state, argv[0]);
     if (val == NULL) {
         return NULL;
     }
     int v = strtol(val, NULL, 10);
     sleep(v);
-    return StringValue(val);
+    return StringValue(strdup(val));
 }
 
 Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        const char* v = EvaluateTransientString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
         fputs(v, stdout);
-        free(v);
     }
     return StringValue(strdup(""));
 }
 
 Value* LogicalAndFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    const char* left = EvaluateTransientString(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == true) {
-        free(left);
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(strdup(left));
     }
 }
 
 Value* LogicalOrFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    const char* left = EvaluateTransientString(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == false) {
-        free(left);
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(strdup(left));
     }
 }
 
 Value* LogicalNotFn(const char* name, State* state,
                     int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    const char* val = EvaluateTransientString(state, argv[0]);
     if (val == NULL) return NULL;
     bool bv = BooleanString(val);
-    free(val);
     return StringValue(strdup(bv ? "" : "t"));
 }
 
 Value* SubstringFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* needle = Evaluate(state, argv[0]);
-    if (needle == NULL) return NULL;
-    char* haystack = Evaluate(state, argv[1]);
-    if (haystack == NULL) {
-        free(needle);
+    char* needle;
+    char* haystack;
+    if (ReadTransientArgs(state, argv, 2, &needle, &haystack) < 0) {
         return NULL;
     }
-
-    char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
-    return StringValue(result);
+    return StringValue(strdup(strstr(haystack, needle) ? "t" : ""));
 }
 
 Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
-    if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
-    if (right == NULL) {
-        free(left);
+    char* left;
+    char* right;
+    if (ReadTransientArgs(state, argv, 2, &left, &right) < 0) {
         return NULL;
     }
-
-    char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    return StringValue(strdup(strcmp(left, right) == 0 ? "t" : ""));
 }
 
 Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
-    if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
-    if (right == NULL) {
-        free(left);
+    char* left;
+    char* right;
+    if (ReadTransientArgs(state, argv, 2, &left, &right) < 0) {
         return NULL;
     }
-
-    char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    return StringValue(strdup(strcmp(left, right) != 0 ? "t" : ""));
 }
 
+// The parser builds a binary node for each ';', but CompileExpr()
+// collapses a chain of them into one node with any number of
+// statements.
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    int i;
+    for (i = 0; i < argc-1; ++i) {
+        // Everything made transient while evaluating a statement is
+        // released as soon as it's done.
+        TransientMark mark = MarkTransient();
+        Value* v = EvaluateTransient(state, argv[i]);
+        ReleaseTransient(mark);
+        if (v == NULL) return NULL;
+    }
+    return EvaluateValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -280,7 +318,7 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char* left;
     char* right;
-    if (ReadArgs(state, argv, 2, &left, &right) < 0) return NULL;
+    if (ReadTransientArgs(state, argv, 2, &left, &right) < 0) return NULL;
 
     bool result = false;
     char* end;
@@ -300,8 +338,6 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
     return StringValue(strdup(result ? "t" : ""));
 }
 
@@ -505,3 +541,361 @@ Value* ErrorAbort(State* state, const char* format, ...) {
     state->errmsg = buffer;
     return NULL;
 }
+
+// -----------------------------------------------------------------
+//   transient values
+// -----------------------------------------------------------------
+
+// Transient allocations are carved out of a list of fixed-size
+// chunks, which are kept for reuse once released.  Allocations too
+// big to share a chunk, and the malloc'd Values returned by
+// functions evaluated with EvaluateTransient(), are "adopted": kept
+// on a list and freed on release.
+
+#define TRANSIENT_CHUNK_SIZE  16384
+#define TRANSIENT_ALIGN       8
+
+typedef struct {
+    void* ptr;
+    bool is_value;
+} Adopted;
+
+static char** chunks = NULL;
+static int chunk_count = 0;
+static int chunk_index = -1;
+static size_t chunk_used = TRANSIENT_CHUNK_SIZE;
+
+static Adopted* adopted = NULL;
+static int adopted_count = 0;
+static int adopted_size = 0;
+
+static void Adopt(void* ptr, bool is_value) {
+    if (adopted_count >= adopted_size) {
+        adopted_size = adopted_size*2 + 16;
+        adopted = realloc(adopted, adopted_size * sizeof(Adopted));
+    }
+    adopted[adopted_count].ptr = ptr;
+    adopted[adopted_count].is_value = is_value;
+    ++adopted_count;
+}
+
+void* AllocTransient(size_t size) {
+    size = (size + TRANSIENT_ALIGN - 1) & ~(size_t)(TRANSIENT_ALIGN - 1);
+    if (size > TRANSIENT_CHUNK_SIZE / 4) {
+        void* p = malloc(size);
+        Adopt(p, false);
+        return p;
+    }
+    if (chunk_used + size > TRANSIENT_CHUNK_SIZE) {
+        ++chunk_index;
+        if (chunk_index == chunk_count) {
+            chunks = realloc(chunks, (chunk_count+1) * sizeof(char*));
+            chunks[chunk_count++] = malloc(TRANSIENT_CHUNK_SIZE);
+        }
+        chunk_used = 0;
+    }
+    void* p = chunks[chunk_index] + chunk_used;
+    chunk_used += size;
+    return p;
+}
+
+TransientMark MarkTransient() {
+    TransientMark mark;
+    mark.chunk = chunk_index;
+    mark.used = chunk_used;
+    mark.adopted = adopted_count;
+    return mark;
+}
+
+void ReleaseTransient(TransientMark mark) {
+    while (adopted_count > mark.adopted) {
+        --adopted_count;
+        if (adopted[adopted_count].is_value) {
+            FreeValue(adopted[adopted_count].ptr);
+        } else {
+            free(adopted[adopted_count].ptr);
+        }
+    }
+    chunk_index = mark.chunk;
+    chunk_used = mark.used;
+}
+
+Value* EvaluateTransient(State* state, Expr* expr) {
+    if (expr->fn == Literal) {
+        // Copy the literal rather than point into the tree, since
+        // callers may modify transient strings in place.
+        size_t len = strlen(expr->name);
+        Value* v = AllocTransient(sizeof(Value) + len + 1);
+        v->type = VAL_STRING;
+        v->size = len;
+        v->data = (char*)(v + 1);
+        memcpy(v->data, expr->name, len + 1);
+        return v;
+    }
+    Value* v = Call(state, expr);
+    if (v != NULL) {
+        Adopt(v, true);
+    }
+    return v;
+}
+
+char* EvaluateTransientString(State* state, Expr* expr) {
+    Value* v = EvaluateTransient(state, expr);
+    if (v == NULL) return NULL;
+    if (v->type != VAL_STRING) {
+        ErrorAbort(state, "expecting string, got value type %d", v->type);
+        return NULL;
+    }
+    return v->data;
+}
+
+int ReadTransientArgs(State* state, Expr* argv[], int count, ...) {
+    va_list v;
+    va_start(v, count);
+    int i;
+    for (i = 0; i < count; ++i) {
+        char* arg = EvaluateTransientString(state, argv[i]);
+        if (arg == NULL) {
+            va_end(v);
+            return -1;
+        }
+        *(va_arg(v, char**)) = arg;
+    }
+    va_end(v);
+    return 0;
+}
+
+char** ReadTransientVarArgs(State* state, int argc, Expr* argv[]) {
+    char** args = AllocTransient((argc > 0 ? argc : 1) * sizeof(char*));
+    int i;
+    for (i = 0; i < argc; ++i) {
+        args[i] = EvaluateTransientString(state, argv[i]);
+        if (args[i] == NULL) {
+            return NULL;
+        }
+    }
+    return args;
+}
+
+Value* EscapeValue(const Value* v) {
+    if (v == NULL) return NULL;
+    Value* copy = malloc(sizeof(Value));
+    copy->type = v->type;
+    copy->size = v->size;
+    ValueStorage* storage = FindValueStorage(v->data);
+    if (storage != NULL) {
+        copy->data = v->data;
+        RetainValueStorage(storage);
+    } else if (v->type == VAL_STRING) {
+        copy->data = malloc(v->size + 1);
+        memcpy(copy->data, v->data, v->size + 1);
+    } else if (v->data == NULL) {
+        copy->data = NULL;
+    } else {
+        copy->data = malloc(v->size > 0 ? v->size : 1);
+        memcpy(copy->data, v->data, v->size);
+    }
+    return copy;
+}
+
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+typedef struct {
+    double wall;              // seconds
+    double cpu;               // seconds, including waited-for children
+    long long read_bytes;     // from storage, or -1 if unknown
+    long long write_bytes;
+    long maxrss;              // KB
+} Usage;
+
+typedef struct {
+    const Expr* expr;
+    Usage cost;
+    bool failed;
+} ProfileEntry;
+
+static bool profiling = false;
+static int call_depth = 0;
+static ProfileEntry* profile = NULL;
+static int profile_count = 0;
+static int profile_size = 0;
+
+static double Seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Read one counter from the text of /proc/self/io.
+static long long IoCounter(const char* io, const char* key) {
+    const char* p = strstr(io, key);
+    return (p == NULL) ? -1 : strtoll(p + strlen(key), NULL, 10);
+}
+
+static void GetUsage(Usage* u) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    u->wall = Seconds(now);
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    u->cpu = Seconds(self.ru_utime) + Seconds(self.ru_stime) +
+             Seconds(children.ru_utime) + Seconds(children.ru_stime);
+    u->maxrss = self.ru_maxrss;
+
+    u->read_bytes = -1;
+    u->write_bytes = -1;
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd >= 0) {
+        char io[512];
+        ssize_t n = read(fd, io, sizeof(io)-1);
+        close(fd);
+        if (n > 0) {
+            io[n] = '\0';
+            u->read_bytes = IoCounter(io, "\nread_bytes: ");
+            u->write_bytes = IoCounter(io, "\nwrite_bytes: ");
+        }
+    }
+}
+
+static long long IoDelta(long long before, long long after) {
+    return (before < 0 || after < 0) ? -1 : after - before;
+}
+
+// Every function call goes through here.  When profiling, calls made
+// at the top level of the script -- the statements of the outermost
+// sequence, or the whole script if it's a single call -- have their
+// cost recorded.
+static Value* Call(State* state, Expr* expr) {
+    if (call_depth == 0 && expr->fn == SequenceFn) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+    if (!profiling || call_depth > 0) {
+        ++call_depth;
+        Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+        --call_depth;
+        return v;
+    }
+
+    Usage before, after;
+    GetUsage(&before);
+    ++call_depth;
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    --call_depth;
+    GetUsage(&after);
+
+    if (profile_count >= profile_size) {
+        profile_size = profile_size*2 + 64;
+        profile = realloc(profile, profile_size * sizeof(ProfileEntry));
+    }
+    ProfileEntry* e = profile + profile_count++;
+    e->expr = expr;
+    e->cost.wall = after.wall - before.wall;
+    e->cost.cpu = after.cpu - before.cpu;
+    e->cost.read_bytes = IoDelta(before.read_bytes, after.read_bytes);
+    e->cost.write_bytes = IoDelta(before.write_bytes, after.write_bytes);
+    e->cost.maxrss = after.maxrss - before.maxrss;
+    e->failed = (v == NULL);
+    return v;
+}
+
+void StartProfiling() {
+    profiling = true;
+    profile_count = 0;
+}
+
+// Copy up to size-1 characters of the source of e, on one line.
+static void SourceText(const State* state, const Expr* e,
+                       char* buffer, size_t size) {
+    size_t len = e->end - e->start;
+    if (len > size-1) len = size-1;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        char c = state->script[e->start + i];
+        buffer[i] = (c == '\n' || c == '\t' || c == '\r') ? ' ' : c;
+    }
+    buffer[len] = '\0';
+}
+
+static int LineNumber(const State* state, int pos) {
+    int line = 1;
+    int i;
+    for (i = 0; i < pos && state->script[i] != '\0'; ++i) {
+        if (state->script[i] == '\n') ++line;
+    }
+    return line;
+}
+
+static int CompareWall(const void* a, const void* b) {
+    double wa = ((const ProfileEntry*)a)->cost.wall;
+    double wb = ((const ProfileEntry*)b)->cost.wall;
+    return (wa < wb) ? 1 : (wa > wb) ? -1 : 0;
+}
+
+#define PROFILE_TOP 20
+
+int WriteProfile(const State* state, const char* path) {
+    char text[256];
+    int result = 0;
+    int i;
+
+    if (path != NULL) {
+        FILE* f = fopen(path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "profile: can't write %s\n", path);
+            result = -1;
+        } else {
+            fprintf(f, "line\tstart\tend\twall_ms\tcpu_ms\tread_bytes\t"
+                    "write_bytes\tmaxrss_delta_kb\tfailed\tsource\n");
+            for (i = 0; i < profile_count; ++i) {
+                const ProfileEntry* e = profile + i;
+                SourceText(state, e->expr, text, sizeof(text));
+                fprintf(f, "%d\t%d\t%d\t%.3f\t%.3f\t%lld\t%lld\t%ld\t%d\t%s\n",
+                        LineNumber(state, e->expr->start),
+                        e->expr->start, e->expr->end,
+                        e->cost.wall * 1000, e->cost.cpu * 1000,
+                        e->cost.read_bytes, e->cost.write_bytes,
+                        e->cost.maxrss, e->failed ? 1 : 0, text);
+            }
+            if (fclose(f) != 0) result = -1;
+        }
+    }
+
+    // The log gets the totals and the slowest calls.
+    Usage total;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < profile_count; ++i) {
+        total.wall += profile[i].cost.wall;
+        total.cpu += profile[i].cost.cpu;
+        if (profile[i].cost.read_bytes > 0) {
+            total.read_bytes += profile[i].cost.read_bytes;
+        }
+        if (profile[i].cost.write_bytes > 0) {
+            total.write_bytes += profile[i].cost.write_bytes;
+        }
+    }
+    printf("profile: %d top-level calls: %.3f s wall, %.3f s cpu, "
+           "%lld KB read, %lld KB written\n",
+           profile_count, total.wall, total.cpu,
+           total.read_bytes >> 10, total.write_bytes >> 10);
+
+    ProfileEntry* sorted = malloc((profile_count > 0 ? profile_count : 1) *
+                                  sizeof(ProfileEntry));
+    memcpy(sorted, profile, profile_count * sizeof(ProfileEntry));
+    qsort(sorted, profile_count, sizeof(ProfileEntry), CompareWall);
+    printf("profile: %9s %9s %9s %9s %8s  %s\n",
+           "wall(ms)", "cpu(ms)", "read(K)", "write(K)", "rss+(K)", "call");
+    for (i = 0; i < profile_count && i < PROFILE_TOP; ++i) {
+        const ProfileEntry* e = sorted + i;
+        SourceText(state, e->expr, text, 60);
+        printf("profile: %9.1f %9.1f %9lld %9lld %8ld  line %d: %s%s\n",
+               e->cost.wall * 1000, e->cost.cpu * 1000,
+               e->cost.read_bytes < 0 ? -1 : e->cost.read_bytes >> 10,
+               e->cost.write_bytes < 0 ? -1 : e->cost.write_bytes >> 10,
+               e->cost.maxrss, LineNumber(state, e->expr->start), text,
+               e->failed ? " (failed)" : "");
+    }
+    free(sorted);
+    return result;
+}
@@ -48,6 +48,21 @@ typedef struct {
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
 #define VAL_BLOB    2
 
+// Read-only memory (length bytes at base) that Values can point into
+// instead of owning a copy of their data.  Each such Value holds a
+// reference; release is called when the last reference goes.
+//
+// Value itself doesn't say where its data lives, since Values built
+// outside edify (eg by updater extensions) only fill in type, size and
+// data.  Instead FreeValue looks data up among the registered storage.
+typedef struct ValueStorage {
+    int refcount;
+    void (*release)(struct ValueStorage* storage);
+    const char* base;
+    size_t length;
+    struct ValueStorage* next;
+} ValueStorage;
+
 typedef struct {
     int type;
     ssize_t size;
@@ -96,6 +111,14 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Rewrite the tree returned by yyparse() into the compact form used
+// for evaluation: sequences are flattened, operators on literals are
+// folded, and the nodes and strings are packed into a few arrays.
+// The original tree is freed.  script is the source, for error
+// messages; any argument count errors found are printed and added to
+// *error_count.
+Expr* CompileExpr(Expr* root, const char* script, int* error_count);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -161,9 +184,81 @@ Value* ErrorAbort(State* state, const char* format, ...) __attribute__((format(p
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
+// Make a VAL_BLOB Value for the size bytes at data, which lie in
+// storage.  Takes a new reference to storage.
+Value* SharedBlobValue(char* data, ssize_t size, ValueStorage* storage);
+
+// Make storage (with refcount, release, base and length set) known to
+// FreeValue.  It stays registered until its last reference is dropped.
+void RegisterValueStorage(ValueStorage* storage);
+
+// Return the registered storage that data points into, or NULL if
+// data is owned by its Value.
+ValueStorage* FindValueStorage(const char* data);
+
+// Take and drop references to storage.  These may be called from any
+// thread.
+void RetainValueStorage(ValueStorage* storage);
+void ReleaseValueStorage(ValueStorage* storage);
+
 // Free a Value object.
 void FreeValue(Value* v);
 
+// --- transient values ---
+
+// Most values a function reads are used once and thrown away.  Those
+// can be evaluated as transient values instead, which come from an
+// arena rather than being malloc'd and freed one at a time.  Every
+// statement of a sequence gets its own scope: anything made transient
+// while evaluating the statement is released when it finishes.
+//
+// Transient values and strings may be modified in place (apart from
+// the data of shared blobs), but must not be freed, or kept after the
+// function that got them returns; use EscapeValue() or strdup() to
+// make a copy that survives.
+
+typedef struct {
+    int chunk;
+    size_t used;
+    int adopted;
+} TransientMark;
+
+// Open a scope for transient values; ReleaseTransient() frees
+// everything made transient since the matching MarkTransient().
+// Scopes must be released in reverse order.
+TransientMark MarkTransient();
+void ReleaseTransient(TransientMark mark);
+
+// Allocate size bytes that live until the current scope is released.
+void* AllocTransient(size_t size);
+
+// Like EvaluateValue() and Evaluate(), except that the result is
+// transient.
+Value* EvaluateTransient(State* state, Expr* expr);
+char* EvaluateTransientString(State* state, Expr* expr);
+
+// Like ReadArgs() and ReadVarArgs(), except that the strings (and
+// the returned array) are transient; there's nothing to free.
+int ReadTransientArgs(State* state, Expr* argv[], int count, ...);
+char** ReadTransientVarArgs(State* state, int argc, Expr* argv[]);
+
+// Return a malloc'd copy of a (transient) Value that the caller owns.
+Value* EscapeValue(const Value* v);
+
+// --- profiling ---
+
+// Start recording the cost of each top-level call of the script (each
+// statement of the outermost sequence): its wall and CPU time, the
+// bytes it read and wrote to storage, and how much it raised the peak
+// RSS.
+void StartProfiling();
+
+// Print a summary of the calls recorded since StartProfiling(), with
+// the slowest ones, to stdout.  If path is not NULL, also write every
+// call, in the order they were made, to that file as tab-separated
+// values.  Returns -1 if the file couldn't be written, otherwise 0.
+int WriteProfile(const State* state, const char* path);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
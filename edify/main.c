@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "expr.h"
 #include "parser.h"
@@ -39,6 +40,13 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         ++*errors;
         return 0;
     }
+    e = CompileExpr(e, expr_str, &error_count);
+    if (error_count > 0) {
+        fprintf(stderr, "error compiling \"%s\" (%d errors)\n",
+                expr_str, error_count);
+        ++*errors;
+        return 0;
+    }
 
     State state;
     state.cookie = NULL;
@@ -154,6 +162,18 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // nested sequences, and operators on values that can't be folded
+    expect("a; (b; c); d", "d", &errors);
+    expect("a; less_than_int(1, 2); \"\"; (b; c)", "c", &errors);
+    expect("\"\" || (t; \"\") || c", "c", &errors);
+    expect("less_than_int(1, 2) && b", "b", &errors);
+    expect("less_than_int(2, 1) || b", "b", &errors);
+    expect("less_than_int(2, 1) + x", "x", &errors);
+    expect("less_than_int(1, 2) == t", "t", &errors);
+    expect("!less_than_int(1, 2)", "", &errors);
+    expect("ifelse(less_than_int(1, 2), yes, no)", "yes", &errors);
+    expect("is_substring(less_than_int(1, 2), abc)", "", &errors);
+
     printf("\n");
 
     return errors;
@@ -173,8 +193,155 @@ void ExprDump(int depth, Expr* n, char* script) {
     }
 }
 
+#ifdef __GLIBC__
+// Count heap allocations, for the benchmark, by interposing on glibc's
+// allocator.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static long alloc_count = 0;
+
+void* malloc(size_t size) {
+    ++alloc_count;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    ++alloc_count;
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    ++alloc_count;
+    return __libc_realloc(ptr, size);
+}
+#else
+static long alloc_count = -1;
+#endif
+
+// A stand-in for the updater's set_perm() and symlink(), which reads
+// its arguments the same way but doesn't touch the filesystem.
+Value* BenchNopFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char** args = ReadTransientVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+    return StringValue(strdup(""));
+}
+
+static int CountStatements(Expr* e) {
+    if (e->fn == SequenceFn) {
+        int count = 0;
+        int i;
+        for (i = 0; i < e->argc; ++i) {
+            count += CountStatements(e->argv[i]);
+        }
+        return count;
+    }
+    return 1;
+}
+
+// Make a script shaped like the permission-setting tail of an OTA
+// package.
+static char* SyntheticScript(int groups) {
+    size_t size = groups * 256 + 1;
+    char* script = malloc(size);
+    char* p = script;
+    int i;
+    for (i = 0; i < groups; ++i) {
+        p += sprintf(p,
+            "set_perm(0, 0, 0644, \"/system/app/App%d.apk\");\n"
+            "symlink(\"toolbox\", \"/system/bin/tool%d\");\n"
+            "ifelse(is_substring(\"x\", \"/system/xbin/su%d\"),"
+            " set_perm(0, 0, 06755, \"/system/xbin/su%d\"));\n"
+            "assert(concat(\"/system/lib/lib\", \"%d\", \".so\") != \"\");\n",
+            i, i, i, i, i);
+    }
+    return script;
+}
+
+// edify -b [iterations [script]]
+//
+// Evaluate a script (by default, a synthetic one using set_perm() and
+// symlink() stand-ins) repeatedly, and report the heap allocations
+// and time per statement.
+int benchmark(int argc, char** argv) {
+    int iterations = argc > 0 ? atoi(argv[0]) : 10;
+    if (iterations <= 0) iterations = 10;
+
+    char* script;
+    if (argc > 1) {
+        FILE* f = fopen(argv[1], "r");
+        if (f == NULL) {
+            printf("%s: No such file or directory\n", argv[1]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        script = malloc(size+1);
+        size = fread(script, 1, size, f);
+        script[size] = '\0';
+        fclose(f);
+    } else {
+        script = SyntheticScript(2500);
+    }
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_string(script);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        printf("%d parse errors\n", error_count);
+        return 1;
+    }
+    root = CompileExpr(root, script, &error_count);
+    if (error_count > 0) {
+        printf("%d compile errors\n", error_count);
+        return 1;
+    }
+    int statements = CountStatements(root);
+
+    struct timeval start, end;
+    long allocs = alloc_count;
+    gettimeofday(&start, NULL);
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        State state;
+        state.cookie = NULL;
+        state.script = script;
+        state.errmsg = NULL;
+
+        char* result = Evaluate(&state, root);
+        if (result == NULL) {
+            printf("script aborted: %s\n",
+                   state.errmsg == NULL ? "(NULL)" : state.errmsg);
+            free(state.errmsg);
+            return 1;
+        }
+        free(result);
+    }
+    gettimeofday(&end, NULL);
+    allocs = alloc_count - allocs;
+
+    double us = (end.tv_sec - start.tv_sec) * 1e6 +
+        (end.tv_usec - start.tv_usec);
+    long total = (long)statements * iterations;
+    printf("%d statements x %d iterations\n", statements, iterations);
+    printf("%.3f us/statement\n", us / total);
+    if (alloc_count >= 0) {
+        printf("%.2f allocations/statement\n", (double)allocs / total);
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     RegisterBuiltins();
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        RegisterFunction("set_perm", BenchNopFn);
+        RegisterFunction("symlink", BenchNopFn);
+        FinishRegistration();
+        return benchmark(argc-2, argv+2);
+    }
     FinishRegistration();
 
     if (argc == 1) {
@@ -196,6 +363,10 @@ int main(int argc, char** argv) {
     yy_scan_bytes(buffer, size);
     int error = yyparse(&root, &error_count);
     printf("parse returned %d; %d errors encountered\n", error, error_count);
+    if (error == 0 && error_count == 0) {
+        root = CompileExpr(root, buffer, &error_count);
+        printf("compile found %d errors\n", error_count);
+    }
     if (error == 0 || error_count > 0) {
 
         ExprDump(0, root, buffer);
@@ -22,9 +22,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
+#include "LabelCache.h"
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
@@ -148,7 +151,7 @@ dirCreateHierarchy(const char *path, int mode,
             char *secontext = NULL;
 
             if (sehnd) {
-                selabel_lookup(sehnd, &secontext, cpath, mode);
+                labelLookup(sehnd, &secontext, cpath, mode);
                 setfscreatecon(secontext);
             }
 
@@ -179,13 +182,292 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+/* A directory being removed.  It can go once it's been read and every
+ * subdirectory found in it is gone; "pending" counts those, plus one
+ * until the reading is done.  Its entries are removed relative to the
+ * descriptor of its open DIR, which stays open until then.
+ */
+typedef struct UnlinkDir {
+    struct UnlinkDir *parent;
+    int parentFd;               /* the parent's descriptor, or AT_FDCWD */
+    char *name;
+    DIR *dir;
+    int pending;
+} UnlinkDir;
+
+/* Each worker takes directories from the back of its own queue, so it
+ * works depth-first and keeps few directories open; an idle worker
+ * steals from the front of another's, which gets it the biggest
+ * subtree that's waiting.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    UnlinkDir **items;
+    int head;
+    int count;
+    int alloc;
+} UnlinkQueue;
+
+typedef struct {
+    UnlinkQueue *queues;
+    int threads;
+
+    /* Guards everything below, and the pending counts. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int queued;                 /* directories in all the queues */
+    bool done;                  /* the top directory is gone */
+    int error;                  /* errno of the first failure */
+    bool wantBytes;
+    DirUnlinkStats stats;
+} UnlinkPool;
+
+typedef struct {
+    UnlinkPool *pool;
+    int index;
+} UnlinkWorker;
+
+static bool
+pushDir(UnlinkQueue *q, UnlinkDir *d)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->alloc) {
+        int alloc = q->alloc * 2 + 16;
+        UnlinkDir **items = (UnlinkDir **)malloc(alloc * sizeof(UnlinkDir *));
+        if (items == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        int i;
+        for (i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->alloc];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->alloc = alloc;
+    }
+    q->items[(q->head + q->count++) % q->alloc] = d;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+static UnlinkDir *
+popDir(UnlinkQueue *q, bool steal)
+{
+    UnlinkDir *d = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        if (steal) {
+            d = q->items[q->head];
+            q->head = (q->head + 1) % q->alloc;
+        } else {
+            d = q->items[(q->head + q->count - 1) % q->alloc];
+        }
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+static bool
+unlinkAborted(UnlinkPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    bool failed = pool->error != 0;
+    pthread_mutex_unlock(&pool->lock);
+    return failed;
+}
+
+static void
+unlinkFailed(UnlinkPool *pool, int err)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->error == 0) {
+        pool->error = err ? err : EIO;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Drops one of d's pending counts; if that was the last, removes d and
+ * does the same for its parent, and so on up.
+ */
+static void
+finishDir(UnlinkPool *pool, UnlinkDir *d)
+{
+    while (d != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        bool last = --d->pending == 0;
+        bool failed = pool->error != 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (!last) {
+            return;
+        }
+
+        if (d->dir != NULL) {
+            closedir(d->dir);
+        }
+        /* after a failure, leave the directories that are left */
+        if (!failed) {
+            if (unlinkat(d->parentFd, d->name, AT_REMOVEDIR) == 0) {
+                pthread_mutex_lock(&pool->lock);
+                pool->stats.dirs++;
+                pthread_mutex_unlock(&pool->lock);
+            } else {
+                unlinkFailed(pool, errno);
+            }
+        }
+
+        UnlinkDir *parent = d->parent;
+        free(d->name);
+        free(d);
+        if (parent == NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->done = true;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        d = parent;
+    }
+}
+
+/* Unlinks the files in d, and queues its subdirectories on q.  The
+ * entry types come from readdir(), so files needn't be stat()ed unless
+ * the bytes they free are wanted.
+ */
+static void
+readUnlinkDir(UnlinkPool *pool, UnlinkQueue *q, UnlinkDir *d)
+{
+    int fd = openat(d->parentFd, d->name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || (d->dir = fdopendir(fd)) == NULL) {
+        unlinkFailed(pool, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    unsigned long files = 0;
+    unsigned long long bytes = 0;
+    while (!unlinkAborted(pool)) {
+        errno = 0;
+        const struct dirent *de = readdir(d->dir);
+        if (de == NULL) {
+            if (errno != 0) {
+                unlinkFailed(pool, errno);
+            }
+            break;
+        }
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+
+        struct stat st;
+        bool haveStat = false;
+        bool isDir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN ||
+                (pool->wantBytes && de->d_type != DT_DIR)) {
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                unlinkFailed(pool, errno);
+                break;
+            }
+            haveStat = true;
+            isDir = S_ISDIR(st.st_mode);
+        }
+
+        if (isDir) {
+            UnlinkDir *child = (UnlinkDir *)calloc(1, sizeof(UnlinkDir));
+            if (child == NULL || (child->name = strdup(de->d_name)) == NULL) {
+                free(child);
+                unlinkFailed(pool, ENOMEM);
+                break;
+            }
+            child->parent = d;
+            child->parentFd = fd;
+            child->pending = 1;
+
+            pthread_mutex_lock(&pool->lock);
+            d->pending++;
+            pthread_mutex_unlock(&pool->lock);
+            if (!pushDir(q, child)) {
+                free(child->name);
+                free(child);
+                unlinkFailed(pool, ENOMEM);
+                finishDir(pool, d);
+                break;
+            }
+            pthread_mutex_lock(&pool->lock);
+            pool->queued++;
+            pthread_cond_signal(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+        } else if (unlinkat(fd, de->d_name, 0) == 0) {
+            files++;
+            /* a file with other links frees nothing */
+            if (haveStat && st.st_nlink <= 1) {
+                bytes += (unsigned long long)st.st_blocks * 512;
+            }
+        } else {
+            unlinkFailed(pool, errno);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.files += files;
+    pool->stats.bytes += bytes;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *
+unlinkWorker(void *cookie)
+{
+    UnlinkWorker *w = (UnlinkWorker *)cookie;
+    UnlinkPool *pool = w->pool;
+    UnlinkQueue *own = &pool->queues[w->index];
+
+    for (;;) {
+        UnlinkDir *d = popDir(own, false);
+        int i;
+        for (i = 1; d == NULL && i < pool->threads; i++) {
+            d = popDir(&pool->queues[(w->index + i) % pool->threads], true);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (d == NULL) {
+            /* nothing to steal; wait until there's something queued,
+             * or the whole tree is gone
+             */
+            while (pool->queued == 0 && !pool->done) {
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            }
+            bool done = pool->done;
+            pthread_mutex_unlock(&pool->lock);
+            if (done) {
+                return NULL;
+            }
+            continue;
+        }
+        pool->queued--;
+        bool failed = pool->error != 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!failed) {
+            readUnlinkDir(pool, own, d);
+        }
+        finishDir(pool, d);
+    }
+}
+
 int
-dirUnlinkHierarchy(const char *path)
+dirUnlinkHierarchyParallel(const char *path, int threads,
+        DirUnlinkStats *stats)
 {
     struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(*stats));
+    }
 
     /* is it a file or directory? */
     if (lstat(path, &st) < 0) {
@@ -194,53 +476,124 @@ dirUnlinkHierarchy(const char *path)
 
     /* a file, so unlink it */
     if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+        if (unlink(path) < 0) {
+            return -1;
+        }
+        if (stats != NULL) {
+            stats->files = 1;
+            stats->bytes = st.st_nlink <= 1 ?
+                    (unsigned long long)st.st_blocks * 512 : 0;
+        }
+        return 0;
     }
 
-    /* a directory, so open handle */
-    dir = opendir(path);
-    if (dir == NULL) {
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+
+    UnlinkPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.threads = threads;
+    pool.wantBytes = stats != NULL;
+    pool.queues = (UnlinkQueue *)calloc(threads, sizeof(UnlinkQueue));
+    UnlinkWorker *workers =
+            (UnlinkWorker *)calloc(threads, sizeof(UnlinkWorker));
+    pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    UnlinkDir *top = (UnlinkDir *)calloc(1, sizeof(UnlinkDir));
+    if (pool.queues == NULL || workers == NULL || tids == NULL ||
+            top == NULL || (top->name = strdup(path)) == NULL) {
+        free(pool.queues);
+        free(workers);
+        free(tids);
+        free(top);
+        errno = ENOMEM;
         return -1;
     }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    int i;
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
 
-    /* recurse over components */
-    errno = 0;
-    while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
-        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-            continue;
-        }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
+    top->parentFd = AT_FDCWD;
+    top->pending = 1;
+    pushDir(&pool.queues[0], top);
+    pool.queued = 1;
+
+    /* this thread is worker 0 */
+    int started = 1;
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, unlinkWorker, &workers[i]) != 0) {
             break;
         }
-        errno = 0;
+        started++;
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
-        return -1;
+    unlinkWorker(&workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
     }
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].items);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.queues);
+    free(workers);
+    free(tids);
+
+    if (stats != NULL) {
+        *stats = pool.stats;
+    }
+    if (pool.error != 0) {
+        errno = pool.error;
         return -1;
     }
-
-    /* delete target directory */
-    return rmdir(path);
+    return 0;
 }
 
 int
-dirSetHierarchyPermissions(const char *path,
+dirUnlinkHierarchy(const char *path)
+{
+    return dirUnlinkHierarchyParallel(path, 0, NULL);
+}
+
+/* chown and chmod name, relative to dirfd, skipping either call if st
+ * shows it has nothing to do.  A chown can clear the set-id bits, so a
+ * chmod always follows one.  flags is passed to fchownat().
+ */
+static int
+setOwnerAndModeAt(int dirfd, const char *name, const struct stat *st,
+        int uid, int gid, int mode, int flags)
+{
+    bool chowned = false;
+    if (st->st_uid != (uid_t)uid || st->st_gid != (gid_t)gid) {
+        if (fchownat(dirfd, name, uid, gid, flags)) {
+            return -1;
+        }
+        chowned = true;
+    }
+    if (chowned || (st->st_mode & 07777) != (mode_t)(mode & 07777)) {
+        if (fchmodat(dirfd, name, mode, 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+setHierarchyPermissionsAt(int dirfd, const char *name,
         int uid, int gid, int dirMode, int fileMode)
 {
     struct stat st;
-    if (lstat(path, &st)) {
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
         return -1;
     }
 
@@ -250,15 +603,22 @@ dirSetHierarchyPermissions(const char *path,
     }
 
     /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (setOwnerAndModeAt(dirfd, name, &st, uid, gid,
+            S_ISDIR(st.st_mode) ? dirMode : fileMode, AT_SYMLINK_NOFOLLOW)) {
         return -1;
     }
 
-    /* recurse over directory components */
+    /* recurse over directory components, relative to the directory's
+     * descriptor rather than by path
+     */
     if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0) {
+            return -1;
+        }
+        DIR *dir = fdopendir(fd);
         if (dir == NULL) {
+            close(fd);
             return -1;
         }
 
@@ -269,9 +629,8 @@ dirSetHierarchyPermissions(const char *path,
                 continue;
             }
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
+            if (!setHierarchyPermissionsAt(fd, de->d_name,
+                    uid, gid, dirMode, fileMode)) {
                 errno = 0;
             } else if (errno == 0) {
                 errno = -1;
@@ -292,3 +651,89 @@ dirSetHierarchyPermissions(const char *path,
 
     return 0;
 }
+
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    return setHierarchyPermissionsAt(AT_FDCWD, path,
+            uid, gid, dirMode, fileMode);
+}
+
+int
+dirSetPermissions(DirPermission *perms, int count)
+{
+    char dirPath[PATH_MAX];
+    int dirfd = -1;
+    int failed = 0;
+    int i;
+
+    dirPath[0] = '\0';
+    for (i = 0; i < count; ++i) {
+        DirPermission *p = &perms[i];
+
+        /* Split the path into its directory, which is only opened
+         * again when it differs from the last entry's, and its name
+         * within that directory.
+         */
+        const char *slash = strrchr(p->path, '/');
+        const char *name;
+        char dir[PATH_MAX];
+        if (slash == NULL) {
+            strcpy(dir, ".");
+            name = p->path;
+        } else {
+            size_t len = (slash == p->path) ? 1 : (size_t)(slash - p->path);
+            if (len >= sizeof(dir)) {
+                p->error = ENAMETOOLONG;
+                ++failed;
+                continue;
+            }
+            memcpy(dir, p->path, len);
+            dir[len] = '\0';
+            name = slash + 1;
+        }
+        if (name[0] == '\0') {
+            name = ".";
+        }
+
+        if (dirfd < 0 || strcmp(dir, dirPath) != 0) {
+            if (dirfd >= 0) {
+                close(dirfd);
+            }
+            dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+            if (dirfd < 0) {
+                dirPath[0] = '\0';
+                p->error = errno;
+                ++failed;
+                continue;
+            }
+            strcpy(dirPath, dir);
+        }
+
+        int ret;
+        if (p->recursive) {
+            ret = setHierarchyPermissionsAt(dirfd, name,
+                    p->uid, p->gid, p->dirMode, p->mode);
+        } else {
+            /* like chown() and chmod(), follow symlinks */
+            struct stat st;
+            ret = fstatat(dirfd, name, &st, 0);
+            if (ret == 0) {
+                ret = setOwnerAndModeAt(dirfd, name, &st,
+                        p->uid, p->gid, p->mode, 0);
+            }
+        }
+        if (ret != 0) {
+            p->error = (errno > 0) ? errno : EIO;
+            ++failed;
+        } else {
+            p->error = 0;
+        }
+    }
+
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    return failed;
+}
@@ -48,6 +48,21 @@ int dirCreateHierarchy(const char *path, int mode,
  */
 int dirUnlinkHierarchy(const char *path);
 
+typedef struct {
+    unsigned long files;        /* everything but directories */
+    unsigned long dirs;
+    unsigned long long bytes;   /* freed by the files (st_blocks) */
+} DirUnlinkStats;
+
+/* rm -rf <path>, with subdirectories removed on up to <threads>
+ * threads (zero means one per CPU).  Stops at the first failure, and
+ * returns -1 with errno set from it.  If stats is non-NULL, it's set
+ * to what was removed, even on failure; counting bytes needs a stat()
+ * of each file, which is skipped otherwise.
+ */
+int dirUnlinkHierarchyParallel(const char *path, int threads,
+        DirUnlinkStats *stats);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
@@ -56,6 +71,28 @@ int dirUnlinkHierarchy(const char *path);
 int dirSetHierarchyPermissions(const char *path,
          int uid, int gid, int dirMode, int fileMode);
 
+/* One change for dirSetPermissions(): chown and chmod of path, or if
+ * recursive is set, dirSetHierarchyPermissions() of path with <mode>
+ * as the file mode.
+ */
+typedef struct {
+    const char *path;
+    int uid;
+    int gid;
+    int mode;
+    int dirMode;        /* recursive only */
+    bool recursive;
+    int error;          /* set to the errno of a failure, or 0 */
+} DirPermission;
+
+/* Apply a list of permission changes.  Each path is resolved relative
+ * to its parent directory, which is only opened once for consecutive
+ * entries in the same directory, and owners and modes that are
+ * already right are left alone.  Returns the number of entries that
+ * failed.
+ */
+int dirSetPermissions(DirPermission *perms, int count);
+
 #ifdef __cplusplus
 }
 #endif
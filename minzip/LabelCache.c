@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Each selabel_lookup() matches the path against every regex in
+ * file_contexts.  Extracting /system looks up thousands of files,
+ * nearly all in directories that the spec labels wholesale, so the
+ * lookups are remembered here.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "Hash.h"
+#include "LabelCache.h"
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+
+/* One regex of the spec, reduced to what the directory check needs. */
+typedef struct {
+    char *stem;         /* the literal text before any regex syntax */
+    enum {
+        SPEC_EXACT,     /* "<stem>": just that path */
+        SPEC_SUBTREE,   /* "<stem>(/.*)?" or "<stem>/.*" */
+        SPEC_OTHER,
+    } kind;
+} Spec;
+
+/* A remembered lookup, of a path, or (for a directory that's labeled
+ * wholesale) of any file of one type in the directory.
+ */
+typedef struct {
+    char *path;
+    int mode;
+    bool uniform;       /* directory entries: one label for all files */
+    bool resolved;      /* con and err hold a result */
+    char *con;
+    int err;
+} LabelEntry;
+
+static struct selabel_handle *gHandle = NULL;
+static Spec *gSpecs = NULL;
+static int gSpecCount = 0;
+static HashTable *gPaths = NULL;
+static HashTable *gDirs = NULL;
+
+static unsigned int
+hashPath(const char *path, int mode)
+{
+    unsigned int hash = mode;
+    while (*path) {
+        hash = hash * 31 + *path++;
+    }
+    return hash;
+}
+
+static int
+compareEntry(const void *tableItem, const void *looseItem)
+{
+    const LabelEntry *a = (const LabelEntry *)tableItem;
+    const LabelEntry *b = (const LabelEntry *)looseItem;
+    if (a->mode != b->mode) {
+        return 1;
+    }
+    return strcmp(a->path, b->path);
+}
+
+static void
+freeEntry(void *ptr)
+{
+    LabelEntry *e = (LabelEntry *)ptr;
+    free(e->path);
+    freecon(e->con);
+    free(e);
+}
+
+static void
+freeCache(void)
+{
+    int i;
+    for (i = 0; i < gSpecCount; ++i) {
+        free(gSpecs[i].stem);
+    }
+    free(gSpecs);
+    gSpecs = NULL;
+    gSpecCount = 0;
+    mzHashTableFree(gPaths);
+    mzHashTableFree(gDirs);
+    gPaths = NULL;
+    gDirs = NULL;
+}
+
+static void
+parseSpec(const char *regex, Spec *spec)
+{
+    size_t len = strcspn(regex, ".^$?*+|[]{}()\\");
+    const char *rest = regex + len;
+
+    if (*rest == '\0') {
+        spec->kind = SPEC_EXACT;
+    } else if (!strcmp(rest, "(/.*)?")) {
+        spec->kind = SPEC_SUBTREE;
+    } else if (len > 0 && regex[len-1] == '/' && !strcmp(rest, ".*")) {
+        /* "<stem>/.*"; keep the stem without its slash */
+        spec->kind = SPEC_SUBTREE;
+        --len;
+    } else {
+        spec->kind = SPEC_OTHER;
+    }
+    spec->stem = strndup(regex, len);
+}
+
+int
+labelCacheInit(struct selabel_handle *sehnd, const char *specFile)
+{
+    freeCache();
+    gHandle = sehnd;
+    gPaths = mzHashTableCreate(256, freeEntry);
+    gDirs = mzHashTableCreate(64, freeEntry);
+
+    FILE *f = fopen(specFile, "r");
+    if (f == NULL) {
+        LOGW("Can't read %s: %s\n", specFile, strerror(errno));
+        return -1;
+    }
+
+    int alloc = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *save;
+        char *regex = strtok_r(line, " \t\r\n", &save);
+        if (regex == NULL || regex[0] == '#') {
+            continue;
+        }
+        if (gSpecCount == alloc) {
+            alloc = alloc * 2 + 64;
+            gSpecs = (Spec *)realloc(gSpecs, alloc * sizeof(Spec));
+        }
+        parseSpec(regex, &gSpecs[gSpecCount++]);
+    }
+    fclose(f);
+    return 0;
+}
+
+static bool
+isPrefix(const char *prefix, size_t prefixLen, const char *s)
+{
+    return strncmp(prefix, s, prefixLen) == 0;
+}
+
+/* Whether every file under "dir" (given with a trailing slash) gets
+ * the same label, for a given file type.  That's so if every spec that
+ * could match such a file matches all of them: it's a subtree of dir
+ * or one of its ancestors.  Regexes are only looked at as far as their
+ * literal stem, so a spec with a short stem stops this for everything
+ * under it.
+ */
+static bool
+isUniformDir(const char *dir)
+{
+    size_t dirLen = strlen(dir);
+    int i;
+
+    if (gSpecs == NULL) {
+        return false;
+    }
+    for (i = 0; i < gSpecCount; ++i) {
+        const Spec *spec = &gSpecs[i];
+        size_t stemLen = strlen(spec->stem);
+
+        switch (spec->kind) {
+        case SPEC_EXACT:
+            /* only a problem if it names something under dir */
+            if (stemLen > dirLen && isPrefix(dir, dirLen, spec->stem)) {
+                return false;
+            }
+            break;
+        case SPEC_SUBTREE:
+            /* fine if it covers all of dir; a problem if it covers
+             * part of it
+             */
+            if (stemLen < dirLen && isPrefix(spec->stem, stemLen, dir) &&
+                dir[stemLen] == '/') {
+                break;
+            }
+            if (stemLen + 1 == dirLen && isPrefix(spec->stem, stemLen, dir)) {
+                break;
+            }
+            if (stemLen >= dirLen && isPrefix(dir, dirLen, spec->stem)) {
+                return false;
+            }
+            break;
+        case SPEC_OTHER:
+            /* anything that could match under dir */
+            if (isPrefix(spec->stem, stemLen < dirLen ? stemLen : dirLen,
+                    dir)) {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+static LabelEntry *
+findEntry(HashTable *table, const char *path, int mode, bool doAdd)
+{
+    LabelEntry key;
+    key.path = (char *)path;
+    key.mode = mode;
+
+    unsigned int hash = hashPath(path, mode);
+    LabelEntry *e = (LabelEntry *)mzHashTableLookup(table, hash, &key,
+            compareEntry, false);
+    if (e != NULL || !doAdd) {
+        return e;
+    }
+
+    e = (LabelEntry *)calloc(1, sizeof(LabelEntry));
+    e->path = strdup(path);
+    e->mode = mode;
+    return (LabelEntry *)mzHashTableLookup(table, hash, e, compareEntry, true);
+}
+
+static int
+copyResult(const LabelEntry *e, char **con)
+{
+    if (e->con == NULL) {
+        *con = NULL;
+        errno = e->err;
+        return -1;
+    }
+    *con = strdup(e->con);
+    return 0;
+}
+
+int
+labelLookup(struct selabel_handle *sehnd, char **con,
+        const char *path, int mode)
+{
+    if (sehnd != gHandle || gPaths == NULL) {
+        return selabel_lookup(sehnd, con, path, mode);
+    }
+
+    LabelEntry *e = findEntry(gPaths, path, mode, false);
+    if (e != NULL) {
+        return copyResult(e, con);
+    }
+
+    /* The directory's entry is keyed by the type of file, since specs
+     * can be limited to a type.
+     */
+    LabelEntry *dirEntry = NULL;
+    const char *slash = strrchr(path, '/');
+    if (slash != NULL && slash[1] != '\0') {
+        char *dir = strndup(path, slash - path + 1);
+        dirEntry = findEntry(gDirs, dir, mode & S_IFMT, false);
+        if (dirEntry == NULL) {
+            dirEntry = findEntry(gDirs, dir, mode & S_IFMT, true);
+            dirEntry->uniform = isUniformDir(dir);
+        }
+        free(dir);
+        if (dirEntry->uniform && dirEntry->resolved) {
+            return copyResult(dirEntry, con);
+        }
+    }
+
+    char *result = NULL;
+    int ret = selabel_lookup(sehnd, &result, path, mode);
+    int err = errno;
+
+    LabelEntry *target = (dirEntry != NULL && dirEntry->uniform) ?
+            dirEntry : findEntry(gPaths, path, mode, true);
+    target->resolved = true;
+    target->con = (ret == 0 && result != NULL) ? strdup(result) : NULL;
+    target->err = err;
+
+    *con = result;
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MINZIP_LABELCACHE_H_
+#define MINZIP_LABELCACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <selinux/selinux.h>
+#include <selinux/label.h>
+
+/* Read the file_contexts spec that "sehnd" was opened with, so that
+ * labelLookup() can tell which directories have one label for all
+ * their files.  Without this, labelLookup() only remembers the
+ * lookups it has made.  Returns 0 on success, -1 if the spec can't
+ * be read.
+ */
+int labelCacheInit(struct selabel_handle *sehnd, const char *specFile);
+
+/* A caching selabel_lookup(): same arguments and results, and *con is
+ * to be freed with freecon() as usual.
+ *
+ * Results are remembered by path and mode.  Where the spec gives every
+ * file of a directory the same label (the directory is only matched
+ * by specs of the form "<dir or ancestor>(/.*)?"), the first lookup of
+ * a file in it answers for the rest of the files of that type.
+ */
+int labelLookup(struct selabel_handle *sehnd, char **con,
+        const char *path, int mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MINZIP_LABELCACHE_H_ */
@@ -19,6 +19,7 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "LabelCache.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -846,6 +847,21 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     return true;
 }
 
+/*
+ * Return a pointer to the contents of a STORED entry within the
+ * archive's mapping, or NULL if the entry is compressed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->compression != STORED ||
+        pEntry->compLen != pEntry->uncompLen) {
+        return NULL;
+    }
+    /* parseZipArchive() checked that the data lies within the map */
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
 
 /* Helper state to make path translation easier and less malloc-happy.
  */
@@ -1119,7 +1135,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 char *secontext = NULL;
 
                 if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+                    labelLookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
                     setfscreatecon(secontext);
                 }
 
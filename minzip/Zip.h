@@ -182,6 +182,14 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * If "pEntry" is stored uncompressed, return a pointer to its
+ * contents in the archive's read-only mapping, which stays valid
+ * until the archive is closed.  Returns NULL for compressed entries.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -19,6 +19,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -34,21 +36,43 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+
+    /* The text of /proc/mounts; the volumes' strings point into it.
+     */
+    char *text;
+    size_t text_allocd;
+
+    /* Indices of the volumes (plus one; zero is empty), hashed by
+     * device and by mount point.  hash_size is a power of two.
+     */
+    int *by_device;
+    int *by_mount_point;
+    int hash_size;
+
+    /* Kept open so that poll() can say when the table has changed.
+     */
+    int fd;
+    int valid;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    NULL,   // text
+    0,      // text_allocd
+    NULL,   // by_device
+    NULL,   // by_mount_point
+    0,      // hash_size
+    -1,     // fd
+    0       // valid
 };
 
 static inline void
 free_volume_internals(const MountedVolume *volume, int zero)
 {
-    free((char *)volume->device);
-    free((char *)volume->mount_point);
-    free((char *)volume->filesystem);
-    free((char *)volume->flags);
+    /* The strings belong to g_mounts_state.text.
+     */
     if (zero) {
         memset((void *)volume, 0, sizeof(*volume));
     }
@@ -56,46 +80,175 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
-int
-scan_mounted_volumes()
+static unsigned int
+hash_string(const char *s)
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
-    ssize_t nbytes;
+    unsigned int h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static const char *
+volume_key(const MountedVolume *v, int by_device)
+{
+    return by_device ? v->device : v->mount_point;
+}
 
-    if (g_mounts_state.volumes == NULL) {
-        const int numv = 32;
-        MountedVolume *volumes = malloc(numv * sizeof(*volumes));
-        if (volumes == NULL) {
+static void
+hash_volume(int *table, int by_device, int index)
+{
+    const char *key = volume_key(&g_mounts_state.volumes[index], by_device);
+    unsigned int mask = g_mounts_state.hash_size - 1;
+    unsigned int i = hash_string(key) & mask;
+    while (table[i] != 0) {
+        /* Keep the first of several volumes with the same key, as the
+         * linear search used to.
+         */
+        const MountedVolume *v = &g_mounts_state.volumes[table[i] - 1];
+        if (strcmp(volume_key(v, by_device), key) == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    table[i] = index + 1;
+}
+
+static int
+build_hashes()
+{
+    int size = 64;
+    while (size < g_mounts_state.volume_count * 2) {
+        size *= 2;
+    }
+    if (size != g_mounts_state.hash_size) {
+        free(g_mounts_state.by_device);
+        free(g_mounts_state.by_mount_point);
+        g_mounts_state.by_device = malloc(size * sizeof(int));
+        g_mounts_state.by_mount_point = malloc(size * sizeof(int));
+        g_mounts_state.hash_size = size;
+        if (g_mounts_state.by_device == NULL ||
+                g_mounts_state.by_mount_point == NULL) {
+            g_mounts_state.hash_size = 0;
             errno = ENOMEM;
             return -1;
         }
-        g_mounts_state.volumes = volumes;
-        g_mounts_state.volumes_allocd = numv;
-        memset(volumes, 0, numv * sizeof(*volumes));
-    } else {
-        /* Free the old volume strings.
-         */
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            free_volume_internals(&g_mounts_state.volumes[i], 1);
+    }
+    memset(g_mounts_state.by_device, 0, size * sizeof(int));
+    memset(g_mounts_state.by_mount_point, 0, size * sizeof(int));
+
+    int i;
+    for (i = 0; i < g_mounts_state.volume_count; i++) {
+        hash_volume(g_mounts_state.by_device, 1, i);
+        hash_volume(g_mounts_state.by_mount_point, 0, i);
+    }
+    return 0;
+}
+
+/* Read all of /proc/mounts into g_mounts_state.text, however big it
+ * is.  Returns the length, or -1.
+ */
+static ssize_t
+read_mounts_text(int fd)
+{
+    size_t len = 0;
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+    for (;;) {
+        if (len + 1 >= g_mounts_state.text_allocd) {
+            size_t allocd = g_mounts_state.text_allocd ?
+                    g_mounts_state.text_allocd * 2 : 4096;
+            char *text = realloc(g_mounts_state.text, allocd);
+            if (text == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            g_mounts_state.text = text;
+            g_mounts_state.text_allocd = allocd;
+        }
+        ssize_t nbytes = read(fd, g_mounts_state.text + len,
+                g_mounts_state.text_allocd - len - 1);
+        if (nbytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        if (nbytes == 0) break;
+        len += nbytes;
     }
+    g_mounts_state.text[len] = '\0';
+    return len;
+}
+
+/* Split off the next whitespace-separated field of the line at *p,
+ * decoding the octal escapes (like "\040" for a space) that the kernel
+ * uses for whitespace in names.  Returns NULL at the end of the line.
+ */
+static char *
+next_field(char **p)
+{
+    char *s = *p;
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+
+    char *field = s;
+    char *out = s;
+    while (*s != '\0' && *s != ' ' && *s != '\t') {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+                s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+            s += 4;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    if (*s != '\0') {
+        s++;
+    }
+    *out = '\0';
+    *p = s;
+    return field;
+}
+
+/* Re-read the table if it's changed since the last scan.  The kernel
+ * flags a change to the mount table as an exceptional condition on
+ * an open /proc/mounts, so an unchanged table costs one poll().
+ */
+int
+scan_mounted_volumes()
+{
+    if (g_mounts_state.fd < 0) {
+        g_mounts_state.fd = open(PROC_MOUNTS_FILENAME, O_RDONLY | O_CLOEXEC);
+        if (g_mounts_state.fd < 0) {
+            goto bail;
+        }
+        g_mounts_state.valid = 0;
+    }
+
+    if (g_mounts_state.valid) {
+        struct pollfd pfd;
+        pfd.fd = g_mounts_state.fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) == 0) {
+            return 0;
+        }
+    }
+    g_mounts_state.valid = 0;
     g_mounts_state.volume_count = 0;
 
-    /* Open and read the file contents.
+    /* Read the file contents.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    ssize_t nbytes = read_mounts_text(g_mounts_state.fd);
     if (nbytes < 0) {
         goto bail;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -110,92 +263,91 @@ scan_mounted_volumes()
      *
      * The zeroes at the end are dummy placeholder fields to make the
      * output match Linux's /etc/mtab, but don't represent anything here.
+     * The fields are split in place.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[64];
-        char mount_point[64];
-        char filesystem[64];
-        char flags[128];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
+    char *bufp = g_mounts_state.text;
+    while (*bufp != '\0') {
+        char *line = bufp;
+        char *eol = strchr(line, '\n');
+        if (eol != NULL) {
+            *eol = '\0';
+            bufp = eol + 1;
+        } else {
+            bufp = line + strlen(line);
+        }
 
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
+        char *p = line;
+        char *device = next_field(&p);
+        char *mount_point = next_field(&p);
+        char *filesystem = next_field(&p);
+        char *flags = next_field(&p);
 
+        if (flags != NULL) {
+            if (g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+                int numv = g_mounts_state.volumes_allocd ?
+                        g_mounts_state.volumes_allocd * 2 : 32;
+                MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                        numv * sizeof(*volumes));
+                if (volumes == NULL) {
+                    errno = ENOMEM;
+                    goto bail;
+                }
+                g_mounts_state.volumes = volumes;
+                g_mounts_state.volumes_allocd = numv;
+            }
             MountedVolume *v =
                     &g_mounts_state.volumes[g_mounts_state.volume_count++];
-            v->device = strdup(device);
-            v->mount_point = strdup(mount_point);
-            v->filesystem = strdup(filesystem);
-            v->flags = strdup(flags);
-        } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
-        }
-
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
-        }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
+            v->device = device;
+            v->mount_point = mount_point;
+            v->filesystem = filesystem;
+            v->flags = flags;
+        } else if (device != NULL) {
+            printf("too few fields on <<%.40s>>\n", line);
         }
     }
 
+    if (build_hashes() != 0) {
+        goto bail;
+    }
+    g_mounts_state.valid = 1;
     return 0;
 
 bail:
-//TODO: free the strings we've allocated.
     g_mounts_state.volume_count = 0;
     return -1;
 }
 
-const MountedVolume *
-find_mounted_volume_by_device(const char *device)
+static const MountedVolume *
+find_mounted_volume(const int *table, int by_device, const char *key)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->device != NULL) {
-                if (strcmp(v->device, device) == 0) {
-                    return v;
-                }
-            }
+    if (g_mounts_state.hash_size == 0 || g_mounts_state.volume_count == 0) {
+        return NULL;
+    }
+    unsigned int mask = g_mounts_state.hash_size - 1;
+    unsigned int i = hash_string(key) & mask;
+    while (table[i] != 0) {
+        const MountedVolume *v = &g_mounts_state.volumes[table[i] - 1];
+        const char *name = volume_key(v, by_device);
+        /* May be null if it was unmounted and we haven't rescanned.
+         */
+        if (name != NULL && strcmp(name, key) == 0) {
+            return v;
         }
+        i = (i + 1) & mask;
     }
     return NULL;
 }
 
+const MountedVolume *
+find_mounted_volume_by_device(const char *device)
+{
+    return find_mounted_volume(g_mounts_state.by_device, 1, device);
+}
+
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->mount_point != NULL) {
-                if (strcmp(v->mount_point, mount_point) == 0) {
-                    return v;
-                }
-            }
-        }
-    }
-    return NULL;
+    return find_mounted_volume(g_mounts_state.by_mount_point, 0, mount_point);
 }
 
 int
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -28,20 +29,39 @@
 
 #include "mtdutils.h"
 
+enum { BLOCK_UNKNOWN = 0, BLOCK_GOOD, BLOCK_BAD };
+
+// The bad-block tables are kept in /tmp for the rest of the session,
+// so later processes needn't ask the driver about every block again.
+#define MTD_BBT_FILENAME    "/tmp/.mtd_bbt.%s"
+#define MTD_BBT_MAGIC       0x31544242  // "BBT1"
+
+static pthread_mutex_t g_block_status_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+
+    // Bad-block status of each erase block (BLOCK_*), filled in as
+    // blocks are asked about, and shared by every read, write and
+    // erase of the partition; see block_is_bad().
+    unsigned char *block_status;
+    int block_status_dirty;
 };
 
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
     size_t consumed;
+    size_t buffered;        // bytes of buffer holding data
+    int window;             // erase blocks to read at a time
     int fd;
 };
 
+enum { VERIFY_IDLE, VERIFY_QUEUED, VERIFY_OK, VERIFY_FAILED };
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
@@ -51,6 +71,23 @@ struct MtdWriteContext {
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    // Each block is read back on the verifier thread while the next
+    // one is erased and written; see write_block().  The blocks are
+    // written from copies, in two slots, since a failed verification
+    // means writing the block again.
+    char *slots[2];
+    int slot;
+    off_t next_pos;         // where the next block goes
+    char *verify_buffer;
+    pthread_t verifier;
+    int pipelined;          // the verifier thread is running
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int verify_state;
+    int verify_exit;
+    off_t verify_pos;
+    const char *verify_data;
 };
 
 typedef struct {
@@ -99,6 +136,9 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        free(p->block_status);
+        p->block_status = NULL;
+        p->block_status_dirty = 0;
         p->device_index = -1;
     }
 
@@ -255,11 +295,23 @@ mtd_partition_info(const MtdPartition *partition,
 }
 
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
+{
+    return mtd_read_partition_readahead(partition, 0);
+}
+
+MtdReadContext *mtd_read_partition_readahead(const MtdPartition *partition,
+        size_t readahead)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->window = (readahead + partition->erase_size - 1) / partition->erase_size;
+    if (ctx->window > (int) (partition->size / partition->erase_size)) {
+        ctx->window = partition->size / partition->erase_size;
+    }
+    if (ctx->window < 1) ctx->window = 1;
+
+    ctx->buffer = malloc(ctx->window * partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
@@ -275,17 +327,127 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->consumed = 0;
+    ctx->buffered = 0;
     return ctx;
 }
 
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
+void mtd_read_skip_to(MtdReadContext* ctx, size_t offset) {
+    ctx->consumed = ctx->buffered = 0;
     lseek64(ctx->fd, offset, SEEK_SET);
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+static size_t block_count(const MtdPartition *partition)
+{
+    return partition->size / partition->erase_size;
+}
+
+// Load the partition's table from /tmp, if an earlier pass saved one.
+// Call with g_block_status_lock held.
+static void load_block_status(MtdPartition *partition)
+{
+    size_t count = block_count(partition);
+    partition->block_status = calloc(count + 1, 1);
+    if (partition->block_status == NULL) return;
+
+    char filename[128];
+    snprintf(filename, sizeof(filename), MTD_BBT_FILENAME, partition->name);
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) return;
+    unsigned int header[3];
+    if (fread(header, sizeof(header), 1, f) == 1 &&
+        header[0] == MTD_BBT_MAGIC && header[1] == partition->size &&
+        header[2] == partition->erase_size &&
+        fread(partition->block_status, 1, count, f) == count) {
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    memset(partition->block_status, BLOCK_UNKNOWN, count);
+}
+
+static void save_block_status(const MtdPartition *partition)
+{
+    MtdPartition *p = (MtdPartition *)partition;
+    pthread_mutex_lock(&g_block_status_lock);
+    if (p->block_status != NULL && p->block_status_dirty) {
+        char filename[128], tmp[136];
+        snprintf(filename, sizeof(filename), MTD_BBT_FILENAME, p->name);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+        unsigned int header[3] = { MTD_BBT_MAGIC, p->size, p->erase_size };
+        FILE *f = fopen(tmp, "wb");
+        if (f != NULL) {
+            int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                     fwrite(p->block_status, 1, block_count(p), f) ==
+                         block_count(p);
+            if (fclose(f) == 0 && ok && rename(tmp, filename) == 0) {
+                p->block_status_dirty = 0;
+            } else {
+                unlink(tmp);
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_block_status_lock);
+}
+
+// Whether the block at pos is bad, asking the driver (through fd)
+// only the first time.
+static int block_is_bad(const MtdPartition *partition, int fd, off_t pos)
+{
+    MtdPartition *p = (MtdPartition *)partition;
+    size_t block = pos / p->erase_size;
+    int bad = 0;
+
+    pthread_mutex_lock(&g_block_status_lock);
+    if (p->block_status == NULL) load_block_status(p);
+    if (p->block_status == NULL || block >= block_count(p)) {
+        pthread_mutex_unlock(&g_block_status_lock);
+        loff_t bpos = pos;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        return ret != 0 && !(ret == -1 && errno == EOPNOTSUPP);
+    }
+    if (p->block_status[block] == BLOCK_UNKNOWN) {
+        loff_t bpos = pos;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+            p->block_status[block] = BLOCK_BAD;
+        } else {
+            p->block_status[block] = BLOCK_GOOD;
+        }
+        p->block_status_dirty = 1;
+    }
+    bad = p->block_status[block] == BLOCK_BAD;
+    pthread_mutex_unlock(&g_block_status_lock);
+    return bad;
+}
+
+// Remember a block that writes have given up on, so that reads (and
+// later writes) skip it too.
+static void mark_block_bad(const MtdPartition *partition, off_t pos)
+{
+    MtdPartition *p = (MtdPartition *)partition;
+    size_t block = pos / p->erase_size;
+
+    pthread_mutex_lock(&g_block_status_lock);
+    if (p->block_status == NULL) load_block_status(p);
+    if (p->block_status != NULL && block < block_count(p) &&
+        p->block_status[block] != BLOCK_BAD) {
+        p->block_status[block] = BLOCK_BAD;
+        p->block_status_dirty = 1;
+    }
+    pthread_mutex_unlock(&g_block_status_lock);
+}
+
+// Read up to max_blocks good blocks from the current position into
+// data, skipping bad blocks and blocks with ECC errors.  Runs of good
+// blocks are read with one read() and one pair of ECCGETSTATS calls;
+// if a run has an ECC error, its first block is read again on its own
+// to find out which blocks to keep.  Returns the number of blocks read
+// (at least one), or -1.
+static int read_blocks(const MtdPartition *partition, int fd, char *data,
+        int max_blocks)
 {
     struct mtd_ecc_stats before, after;
     if (ioctl(fd, ECCGETSTATS, &before)) {
@@ -296,30 +458,45 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     loff_t pos = lseek64(fd, 0, SEEK_CUR);
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
+        if (block_is_bad(partition, fd, pos)) {
+            fprintf(stderr, "mtd: not reading bad block at 0x%08llx\n", pos);
+            pos += size;
+            continue;
+        }
+
+        int count = 1;
+        while (count < max_blocks &&
+               pos + (count + 1) * size <= (int) partition->size &&
+               !block_is_bad(partition, fd, pos + count * size)) {
+            ++count;
+        }
+
+        if (lseek64(fd, pos, SEEK_SET) != pos ||
+            read(fd, data, count * size) != count * size) {
+            if (count == 1) {
+                fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
+                        pos, strerror(errno));
+                pos += size;
+            }
+            max_blocks = 1;
         } else if (ioctl(fd, ECCGETSTATS, &after)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
         } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
+            if (count == 1) {
+                fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                        after.corrected - before.corrected,
+                        after.failed - before.failed, pos);
+                pos += size;
+            }
+            max_blocks = 1;
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
         } else {
-            return 0;  // Success!
+            return count;  // Success!
         }
-
-        pos += partition->erase_size;
     }
 
     errno = ENOSPC;
@@ -328,32 +505,35 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
 
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    size_t erase_size = ctx->partition->erase_size;
     size_t read = 0;
     while (read < len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->buffered) {
+            size_t avail = ctx->buffered - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
             read += copy;
+            continue;
         }
 
-        // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
-        }
-
-        if (read >= len) {
-            return read;
+        // Read complete blocks directly into the user's buffer, a
+        // window at a time.
+        int blocks;
+        if (len - read >= erase_size) {
+            blocks = (len - read) / erase_size;
+            if (blocks > ctx->window) blocks = ctx->window;
+            blocks = read_blocks(ctx->partition, ctx->fd, data + read, blocks);
+            if (blocks < 0) return -1;
+            read += blocks * erase_size;
+            continue;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
-            ctx->consumed = 0;
-        }
+        // Read the next window into the buffer
+        blocks = read_blocks(ctx->partition, ctx->fd, ctx->buffer, ctx->window);
+        if (blocks < 0) return -1;
+        ctx->consumed = 0;
+        ctx->buffered = blocks * erase_size;
     }
 
     return read;
@@ -361,23 +541,36 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
+    save_block_status(ctx->partition);
     close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
 }
 
+static void *verify_thread(void *cookie);
+
+static void free_write_context(MtdWriteContext *ctx)
+{
+    free(ctx->bad_block_offsets);
+    free(ctx->slots[0]);
+    free(ctx->slots[1]);
+    free(ctx->verify_buffer);
+    free(ctx->buffer);
+    free(ctx);
+}
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
-        free(ctx);
+    ctx->slots[0] = malloc(partition->erase_size);
+    ctx->slots[1] = malloc(partition->erase_size);
+    ctx->verify_buffer = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->slots[0] == NULL || ctx->slots[1] == NULL ||
+        ctx->verify_buffer == NULL) {
+        free_write_context(ctx);
         return NULL;
     }
 
@@ -385,72 +578,102 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
-        free(ctx->buffer);
-        free(ctx);
+        free_write_context(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->next_pos = 0;
+    ctx->verify_state = VERIFY_IDLE;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    // Without the thread, blocks are verified as they're written.
+    ctx->pipelined = pthread_create(&ctx->verifier, NULL,
+                                    verify_thread, ctx) == 0;
     return ctx;
 }
 
-static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+// Blocks can be passed more than once (when a block is rewritten, the
+// ones after it are too), so keep the list sorted and without
+// repeats.  Returns 0 if pos was already there.
+static int add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+    int i = ctx->bad_block_count;
+    while (i > 0 && ctx->bad_block_offsets[i-1] >= pos) {
+        if (ctx->bad_block_offsets[i-1] == pos) return 0;
+        --i;
+    }
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
         ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
         ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
                                          ctx->bad_block_alloc * sizeof(off_t));
     }
-    ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
+    memmove(ctx->bad_block_offsets + i + 1, ctx->bad_block_offsets + i,
+            (ctx->bad_block_count - i) * sizeof(off_t));
+    ctx->bad_block_offsets[i] = pos;
+    ctx->bad_block_count++;
+    return 1;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+// The first block at or after pos that isn't factory-bad, or -1.
+static off_t next_good_block(MtdWriteContext *ctx, off_t pos)
 {
-    const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
+    ssize_t size = ctx->partition->erase_size;
+    while (pos + size <= (int) ctx->partition->size) {
+        if (!block_is_bad(ctx->partition, ctx->fd, pos)) return pos;
+        if (add_bad_block_offset(ctx, pos)) {
+            fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
+        }
+        pos += size;  // Don't try to erase known factory-bad blocks.
+    }
+    return -1;
+}
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) return 1;
+static int erase_and_program(int fd, off_t pos, const char *data, ssize_t size)
+{
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = size;
+    if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+        fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    if (pwrite(fd, data, size, pos) != size) {
+        fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+    }
+    return 0;
+}
 
-    ssize_t size = partition->erase_size;
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
-            add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
-            pos += partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
-        }
+static int verify_block(int fd, off_t pos, const char *data, char *verify,
+                        ssize_t size)
+{
+    if (pread(fd, verify, size, pos) != size) {
+        fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    if (memcmp(data, verify, size) != 0) {
+        fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
-        int retry;
-        for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
-                fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-            }
+// Write a block serially, starting at pos with "retry" of its tries
+// there already used up.  Returns where it was written, or -1.
+static off_t write_block_at(MtdWriteContext *ctx, const char *data,
+                            off_t pos, int retry)
+{
+    int fd = ctx->fd;
+    ssize_t size = ctx->partition->erase_size;
 
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+    while ((pos = next_good_block(ctx, pos)) >= 0) {
+        for (; retry < 2; ++retry) {
+            if (erase_and_program(fd, pos, data, size) != 0) continue;
+            if (verify_block(fd, pos, data, ctx->verify_buffer, size) != 0) {
                 continue;
             }
 
@@ -458,14 +681,19 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
             fprintf(stderr, "mtd: successfully wrote block at %lx\n", pos);
-            return 0;  // Success!
+            return pos;  // Success!
         }
 
         // Try to erase it once more as we give up on this block
+        struct erase_info_user erase_info;
+        erase_info.start = pos;
+        erase_info.length = size;
         add_bad_block_offset(ctx, pos);
+        mark_block_bad(ctx->partition, pos);
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
-        pos += partition->erase_size;
+        pos += size;
+        retry = 0;
     }
 
     // Ran out of space on the device
@@ -473,6 +701,113 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+static void *verify_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *)cookie;
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->verify_state != VERIFY_QUEUED && !ctx->verify_exit) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->verify_state != VERIFY_QUEUED) break;
+        pthread_mutex_unlock(&ctx->lock);
+
+        int ret = verify_block(ctx->fd, ctx->verify_pos, ctx->verify_data,
+                               ctx->verify_buffer, ctx->partition->erase_size);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->verify_state = ret == 0 ? VERIFY_OK : VERIFY_FAILED;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Wait for the block being verified, if any, and if it failed, write
+// it again serially.  Anything written after it is lost, since the
+// block may now take that place; the caller writes it again.  Returns
+// 0 if the block was written, 1 if it had to be rewritten, and -1 if
+// that failed.
+static int finish_verify(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->verify_state == VERIFY_QUEUED) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int state = ctx->verify_state;
+    ctx->verify_state = VERIFY_IDLE;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (state == VERIFY_OK) {
+        fprintf(stderr, "mtd: successfully wrote block at %lx\n",
+                ctx->verify_pos);
+    } else if (state == VERIFY_FAILED) {
+        off_t pos = write_block_at(ctx, ctx->verify_data, ctx->verify_pos, 1);
+        if (pos < 0) return -1;
+        ctx->next_pos = pos + ctx->partition->erase_size;
+        return 1;
+    }
+    return 0;
+}
+
+// Like finish_verify(), then leave the file position after the last
+// block written, for the callers that go by it.
+static int drain_writes(MtdWriteContext *ctx)
+{
+    if (finish_verify(ctx) < 0) return -1;
+    if (lseek(ctx->fd, ctx->next_pos, SEEK_SET) != ctx->next_pos) return -1;
+    return 0;
+}
+
+// Write a block, to the next good block of the partition, retrying
+// twice and then moving on to the block after if it won't verify.
+// The read-back of each block overlaps the erase and write of the
+// next.
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    ssize_t size = ctx->partition->erase_size;
+    char *copy = ctx->slots[ctx->slot];
+    ctx->slot = !ctx->slot;
+    memcpy(copy, data, size);
+
+    off_t pos = next_good_block(ctx, ctx->next_pos);
+    int programmed = pos >= 0 &&
+                     erase_and_program(ctx->fd, pos, copy, size) == 0;
+
+    int ret = finish_verify(ctx);
+    if (ret < 0) return -1;
+    if (ret > 0 || !programmed || !ctx->pipelined) {
+        // The first try is done serially if the block before it had to
+        // be rewritten (it may have taken this block's place) or the
+        // erase failed (which used up a try).
+        if (ret > 0) {
+            pos = write_block_at(ctx, copy, ctx->next_pos, 0);
+        } else if (pos >= 0) {
+            if (programmed &&
+                verify_block(ctx->fd, pos, copy, ctx->verify_buffer, size) == 0) {
+                fprintf(stderr, "mtd: successfully wrote block at %lx\n", pos);
+            } else {
+                pos = write_block_at(ctx, copy, pos, 1);
+            }
+        }
+        if (pos < 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        ctx->next_pos = pos + size;
+        return 0;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->verify_pos = pos;
+    ctx->verify_data = copy;
+    ctx->verify_state = VERIFY_QUEUED;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    ctx->next_pos = pos + size;
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
@@ -511,6 +846,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         if (write_block(ctx, ctx->buffer)) return -1;
         ctx->stored = 0;
     }
+    if (drain_writes(ctx) != 0) return -1;
 
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
@@ -524,8 +860,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (block_is_bad(ctx->partition, ctx->fd, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -548,10 +883,19 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    if (ctx->pipelined) {
+        finish_verify(ctx);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->verify_exit = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->verifier, NULL);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    save_block_status(ctx->partition);
     if (close(ctx->fd)) r = -1;
-    free(ctx->bad_block_offsets);
-    free(ctx->buffer);
-    free(ctx);
+    free_write_context(ctx);
     return r;
 }
 
@@ -560,6 +904,7 @@ int mtd_write_close(MtdWriteContext *ctx)
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     int i;
+    drain_writes(ctx);
     for (i = 0; i < ctx->bad_block_count; ++i) {
         if (ctx->bad_block_offsets[i] == pos) {
             pos += ctx->partition->erase_size;
@@ -49,7 +49,15 @@ typedef struct MtdWriteContext MtdWriteContext;
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
-void mtd_read_skip_to(const MtdReadContext *, size_t offset);
+void mtd_read_skip_to(MtdReadContext *, size_t offset);
+
+/* like mtd_read_partition(), but reads whole runs of blocks, up to
+ * "readahead" bytes (rounded up to erase blocks) at a time, checking
+ * the ECC stats once per run.  Reads of whole blocks go straight into
+ * the caller's buffer.
+ */
+MtdReadContext *mtd_read_partition_readahead(const MtdPartition *,
+        size_t readahead);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "partitions.h"
+
+typedef struct PartitionEntry {
+    PartitionInfo info;
+    struct PartitionEntry *next;
+} PartitionEntry;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static PartitionEntry *g_entries = NULL;
+static int g_mtd_scanned = 0;
+
+/* The size of a block device, from sysfs ("<n> 512-byte sectors"),
+ * or else from the device itself.  Regular files (images) are allowed
+ * too.
+ */
+static int
+probe_emmc(PartitionInfo *info)
+{
+    char path[PATH_MAX];
+    const char *base = strrchr(info->device, '/');
+    base = base ? base + 1 : info->device;
+
+    info->sector_size = 512;
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", base);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        unsigned long long sectors;
+        int matched = fscanf(f, "%llu", &sectors);
+        fclose(f);
+        if (matched == 1) {
+            info->size = sectors * 512;
+        }
+    }
+
+    int fd = open(info->device, O_RDONLY);
+    if (fd < 0) {
+        return info->size > 0 ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        info->size = st.st_size;
+    } else {
+        int sector_size;
+        unsigned long long size;
+        if (ioctl(fd, BLKSSZGET, &sector_size) == 0) {
+            info->sector_size = sector_size;
+        }
+        if (info->size == 0 && ioctl(fd, BLKGETSIZE64, &size) == 0) {
+            info->size = size;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int
+probe_mtd(PartitionInfo *info)
+{
+    if (!g_mtd_scanned) {
+        if (mtd_scan_partitions() < 0) {
+            return -1;
+        }
+        g_mtd_scanned = 1;
+    }
+    info->mtd = mtd_find_partition_by_name(info->name);
+    if (info->mtd == NULL) {
+        return -1;
+    }
+
+    size_t total_size = 0, erase_size = 0, write_size = 0;
+    mtd_partition_info(info->mtd, &total_size, &erase_size, &write_size);
+    info->size = total_size;
+    info->erase_size = erase_size;
+    info->sector_size = write_size;
+    return 0;
+}
+
+const PartitionInfo *
+partition_index_find(PartitionType type, const char *name)
+{
+    PartitionEntry *e;
+
+    pthread_mutex_lock(&g_lock);
+    for (e = g_entries; e != NULL; e = e->next) {
+        if (e->info.type == type && strcmp(e->info.name, name) == 0) {
+            pthread_mutex_unlock(&g_lock);
+            return &e->info;
+        }
+    }
+
+    e = calloc(1, sizeof(*e));
+    e->info.type = type;
+    e->info.name = strdup(name);
+    int ret;
+    if (type == PARTITION_MTD) {
+        ret = probe_mtd(&e->info);
+    } else {
+        char resolved[PATH_MAX];
+        e->info.device = strdup(realpath(name, resolved) ? resolved : name);
+        ret = probe_emmc(&e->info);
+    }
+    if (ret != 0) {
+        free((char *)e->info.name);
+        free((char *)e->info.device);
+        free(e);
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+    e->next = g_entries;
+    g_entries = e;
+    pthread_mutex_unlock(&g_lock);
+    return &e->info;
+}
+
+void
+partition_index_refresh(void)
+{
+    pthread_mutex_lock(&g_lock);
+    while (g_entries != NULL) {
+        PartitionEntry *e = g_entries;
+        g_entries = e->next;
+        free((char *)e->info.name);
+        free((char *)e->info.device);
+        free(e);
+    }
+    g_mtd_scanned = 0;
+    pthread_mutex_unlock(&g_lock);
+}
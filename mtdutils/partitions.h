@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTDUTILS_PARTITIONS_H_
+#define MTDUTILS_PARTITIONS_H_
+
+#include "mtdutils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PARTITION_MTD,
+    PARTITION_EMMC
+} PartitionType;
+
+typedef struct {
+    PartitionType type;
+    const char *name;       /* MTD name, or eMMC device path as given */
+    const char *device;     /* eMMC only: the path with links resolved */
+    unsigned long long size;
+    size_t erase_size;      /* MTD erase block; 0 for eMMC */
+    size_t sector_size;     /* MTD page, or the device's logical sector */
+    const MtdPartition *mtd;    /* MTD only */
+} PartitionInfo;
+
+/* Look up a partition, probing it only the first time it's asked
+ * for: /proc/mtd is read once, and an eMMC device's links and size
+ * are resolved once.  The result stays valid until the next
+ * partition_index_refresh().  Returns NULL if there is no such
+ * partition.
+ */
+const PartitionInfo *partition_index_find(PartitionType type,
+        const char *name);
+
+/* Forget everything probed, for when partitions may have changed.
+ */
+void partition_index_refresh(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MTDUTILS_PARTITIONS_H_
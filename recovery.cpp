@@ -25,10 +25,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/falloc.h>
 
 #include "bootloader.h"
 #include "common.h"
@@ -60,6 +63,7 @@ static const struct option OPTIONS[] = {
   { "update_package", required_argument, NULL, 'u' },
   { "wipe_data", no_argument, NULL, 'w' },
   { "wipe_cache", no_argument, NULL, 'c' },
+  { "fast_wipe", no_argument, NULL, 'f' },
   { "show_text", no_argument, NULL, 't' },
   { "just_exit", no_argument, NULL, 'x' },
   { "locale", required_argument, NULL, 'l' },
@@ -109,6 +113,7 @@ char* locale = NULL;
  *   --update_package=path - verify install an OTA package file
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
+ *   --fast_wipe - have data wipes discard rather than securely erase
  *   --set_encrypted_filesystem=on|off - enables / diasables encrypted fs
  *   --just_exit - do nothing; exit and reboot
  *
@@ -122,8 +127,8 @@ char* locale = NULL;
  * 3. main system reboots into recovery
  * 4. get_args() writes BCB with "boot-recovery" and "--wipe_data"
  *    -- after this, rebooting will restart the erase --
- * 5. erase_volume() reformats /data
- * 6. erase_volume() reformats /cache
+ * 5. erase_volumes() reformats /data
+ * 6. erase_volumes() reformats /cache, at the same time
  * 7. finish_recovery() erases BCB
  *    -- after this, rebooting will restart the main system --
  * 8. main() calls reboot() to boot main system
@@ -301,6 +306,119 @@ set_sdcard_update_bootloader_message() {
     set_bootloader_message(&boot);
 }
 
+// Called as copy_fd() goes, with the bytes copied so far and the
+// total (0 if it isn't known).
+typedef void (*copy_progress_fn)(off_t copied, off_t total, void* cookie);
+
+// Reserves space for len bytes at offset, so a copy that can't fit
+// fails before it starts.  fallocate() is only called directly on
+// 64-bit builds; 32-bit ABIs split its offsets across registers.
+static int
+preallocate(int fd, off_t offset, off_t len) {
+#if defined(__NR_fallocate) && defined(__LP64__)
+    return syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Copies in_fd to out_fd, from their current offsets to the end of
+// in_fd, without bringing the data into user space where the kernel
+// can do it: copy_file_range() where there is one, else sendfile(),
+// else read() and write() through a 1 MiB buffer.  Returns the number
+// of bytes copied, or -1.
+static off_t
+copy_fd(int in_fd, int out_fd, copy_progress_fn progress, void* cookie) {
+    const size_t kChunk = 8 << 20;   // between progress callbacks
+    const size_t kBufferSize = 1 << 20;
+
+    off_t total = 0;
+    struct stat st;
+    off_t in_pos = lseek(in_fd, 0, SEEK_CUR);
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && in_pos >= 0 &&
+        st.st_size > in_pos) {
+        total = st.st_size - in_pos;
+        off_t out_pos = lseek(out_fd, 0, SEEK_CUR);
+        if (out_pos >= 0 && preallocate(out_fd, out_pos, total) != 0 &&
+            errno == ENOSPC) {
+            return -1;
+        }
+    }
+
+#ifdef __NR_copy_file_range
+    bool use_copy_range = true;
+#else
+    bool use_copy_range = false;
+#endif
+    bool use_sendfile = true;
+    char* buffer = NULL;
+    off_t copied = 0;
+
+    for (;;) {
+        ssize_t n = -1;
+#ifdef __NR_copy_file_range
+        if (use_copy_range) {
+            n = syscall(__NR_copy_file_range, in_fd, NULL, out_fd, NULL,
+                        kChunk, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                          errno == EINVAL || errno == EBADF ||
+                          errno == EOPNOTSUPP)) {
+                use_copy_range = false;
+            } else if (n < 0) {
+                break;
+            }
+        }
+#endif
+        if (!use_copy_range && use_sendfile) {
+            n = sendfile(out_fd, in_fd, NULL, kChunk);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                use_sendfile = false;
+            } else if (n < 0) {
+                break;
+            }
+        }
+        if (!use_copy_range && !use_sendfile) {
+            if (buffer == NULL && (buffer = (char*)malloc(kBufferSize)) == NULL) {
+                break;
+            }
+            n = 0;
+            while ((size_t)n < kChunk) {
+                ssize_t r = TEMP_FAILURE_RETRY(read(in_fd, buffer, kBufferSize));
+                if (r <= 0) {
+                    if (r < 0) n = -1;
+                    break;
+                }
+                for (ssize_t w = 0; w < r; ) {
+                    ssize_t written = TEMP_FAILURE_RETRY(write(out_fd, buffer + w, r - w));
+                    if (written <= 0) {
+                        r = -1;
+                        break;
+                    }
+                    w += written;
+                }
+                if (r < 0) {
+                    n = -1;
+                    break;
+                }
+                n += r;
+            }
+            if (n < 0) break;
+        }
+        if (n == 0) {
+            free(buffer);
+            return copied;
+        }
+        copied += n;
+        if (progress != NULL) progress(copied, total, cookie);
+    }
+
+    int saved_errno = errno;
+    free(buffer);
+    errno = saved_errno;
+    return -1;
+}
+
 // How much of the temp log we have copied to the copy in cache.
 static long tmplog_offset = 0;
 
@@ -310,17 +428,19 @@ copy_log_file(const char* source, const char* destination, int append) {
     if (log == NULL) {
         LOGE("Can't open %s\n", destination);
     } else {
-        FILE *tmplog = fopen(source, "r");
-        if (tmplog != NULL) {
+        int tmplog = open(source, O_RDONLY);
+        if (tmplog >= 0) {
             if (append) {
-                fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
+                lseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
+            }
+            fflush(log);
+            if (copy_fd(tmplog, fileno(log), NULL, NULL) < 0) {
+                LOGE("Error copying %s\n(%s)\n", source, strerror(errno));
             }
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
             if (append) {
-                tmplog_offset = ftell(tmplog);
+                tmplog_offset = lseek(tmplog, 0, SEEK_CUR);
             }
-            check_and_fclose(tmplog, source);
+            close(tmplog);
         }
         check_and_fclose(log, destination);
     }
@@ -404,21 +524,43 @@ finish_recovery(const char *send_intent) {
 }
 
 static int
-erase_volume(const char *volume) {
+erase_volumes(const char* const* volumes, int count, int fast) {
     ui->SetBackground(RecoveryUI::ERASING);
     ui->SetProgressType(RecoveryUI::INDETERMINATE);
-    ui->Print("Formatting %s...\n", volume);
 
-    ensure_path_unmounted(volume);
+    for (int i = 0; i < count; ++i) {
+        ui->Print("Formatting %s...\n", volumes[i]);
+
+        ensure_path_unmounted(volumes[i]);
 
-    if (strcmp(volume, "/cache") == 0) {
-        // Any part of the log we'd copied to cache is now gone.
-        // Reset the pointer so we copy from the beginning of the temp
-        // log.
-        tmplog_offset = 0;
+        if (strcmp(volumes[i], "/cache") == 0) {
+            // Any part of the log we'd copied to cache is now gone.
+            // Reset the pointer so we copy from the beginning of the temp
+            // log.
+            tmplog_offset = 0;
+        }
     }
 
-    return format_volume(volume);
+    return format_volumes(volumes, count, fast);
+}
+
+static int
+erase_volume(const char *volume) {
+    return erase_volumes(&volume, 1, 0);
+}
+
+// /data and /cache are on separate partitions, so a data wipe
+// formats them together.
+static const char* const WIPE_VOLUMES[] = { "/data", "/cache" };
+
+// Set by --fast_wipe.  Data wipes securely erase the devices unless
+// asked not to; a plain discard is much faster on large eMMC parts,
+// but may leave old data readable in the flash.
+static int fast_wipe = 0;
+
+static void
+show_copy_progress(off_t copied, off_t total, void* cookie) {
+    if (total > 0) ui->SetProgress((float) copied / total);
 }
 
 static char*
@@ -464,39 +606,35 @@ copy_sideloaded_package(const char* original_path) {
   strcpy(copy_path, SIDELOAD_TEMP_DIR);
   strcat(copy_path, "/package.zip");
 
-  char* buffer = (char*)malloc(BUFSIZ);
-  if (buffer == NULL) {
-    LOGE("Failed to allocate buffer\n");
-    return NULL;
-  }
-
-  size_t read;
-  FILE* fin = fopen(original_path, "rb");
-  if (fin == NULL) {
+  int fin = open(original_path, O_RDONLY);
+  if (fin < 0) {
     LOGE("Failed to open %s (%s)\n", original_path, strerror(errno));
     return NULL;
   }
-  FILE* fout = fopen(copy_path, "wb");
-  if (fout == NULL) {
+  int fout = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fout < 0) {
     LOGE("Failed to open %s (%s)\n", copy_path, strerror(errno));
+    close(fin);
     return NULL;
   }
 
-  while ((read = fread(buffer, 1, BUFSIZ, fin)) > 0) {
-    if (fwrite(buffer, 1, read, fout) != read) {
-      LOGE("Short write of %s (%s)\n", copy_path, strerror(errno));
-      return NULL;
-    }
+  ui->SetProgressType(RecoveryUI::DETERMINATE);
+  ui->ShowProgress(1.0, 0);
+  if (copy_fd(fin, fout, show_copy_progress, NULL) < 0) {
+    LOGE("Failed to copy %s (%s)\n", original_path, strerror(errno));
+    close(fin);
+    close(fout);
+    return NULL;
   }
+  ui->SetProgressType(RecoveryUI::EMPTY);
 
-  free(buffer);
-
-  if (fclose(fout) != 0) {
+  if (close(fout) != 0) {
     LOGE("Failed to close %s (%s)\n", copy_path, strerror(errno));
+    close(fin);
     return NULL;
   }
 
-  if (fclose(fin) != 0) {
+  if (close(fin) != 0) {
     LOGE("Failed to close %s (%s)\n", original_path, strerror(errno));
     return NULL;
   }
@@ -883,8 +1021,7 @@ wipe_data(int confirm, Device* device) {
     ui->Print("\n-- Wiping data...\n");
     device->WipeData();
 	save_userdata_ver_info();//czb@tcl.com save userdata.ver
-    erase_volume("/data");
-    erase_volume("/cache");
+    erase_volumes(WIPE_VOLUMES, 2, fast_wipe);
 	restore_userdata_ver_info();//czb@tcl.com restore userdata.ver
     ui->Print("Data wipe complete.\n");
 }
@@ -1381,6 +1518,7 @@ main(int argc, char **argv) {
         case 'u': update_package = optarg; break;
         case 'w': wipe_data = wipe_cache = 1; break;
         case 'c': wipe_cache = 1; break;
+        case 'f': fast_wipe = 1; break;
         case 't': show_text = 1; break;
         case 'x': just_exit = true; break;
         case 'l': locale = optarg; break;
@@ -1582,9 +1720,8 @@ main(int argc, char **argv) {
     } else if (wipe_data) {
         if (device->WipeData()) status = INSTALL_ERROR;
 		save_userdata_ver_info();//czb@tcl.com save userdata.ver
-        if (erase_volume("/data")) status = INSTALL_ERROR;
+        if (erase_volumes(WIPE_VOLUMES, wipe_cache ? 2 : 1, fast_wipe)) status = INSTALL_ERROR;
 		restore_userdata_ver_info();//czb@tcl.com restore userdata.ver
-        if (wipe_cache && erase_volume("/cache")) status = INSTALL_ERROR;
         if (status != INSTALL_SUCCESS) ui->Print("Data wipe failed.\n");
     } else if (wipe_cache) {
         if (wipe_cache && erase_volume("/cache")) status = INSTALL_ERROR;
@@ -15,12 +15,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <linux/fs.h>
 
 #include <fs_mgr.h>
 #include "mtdutils/mtdutils.h"
@@ -28,6 +33,7 @@
 #include "roots.h"
 #include "common.h"
 #include "make_ext4fs.h"
+#include "ext4_utils.h"
 
 static struct fstab *fstab = NULL;
 
@@ -146,27 +152,66 @@ int ensure_path_unmounted(const char* path) {
     return unmount_mounted_volume(mv);
 }
 
-int format_volume(const char* volume) {
+// Checks that "volume" is a mount point that can be formatted, and
+// unmounts it.
+static Volume* volume_to_format(const char* volume) {
     Volume* v = volume_for_path(volume);
     if (v == NULL) {
         LOGE("unknown volume \"%s\"\n", volume);
-        return -1;
+        return NULL;
     }
     if (strcmp(v->fs_type, "ramdisk") == 0) {
         // you can't format the ramdisk.
         LOGE("can't format_volume \"%s\"", volume);
-        return -1;
+        return NULL;
     }
     if (strcmp(v->mount_point, volume) != 0) {
         LOGE("can't give path \"%s\" to format_volume\n", volume);
-        return -1;
+        return NULL;
     }
 
     if (ensure_path_unmounted(volume) != 0) {
         LOGE("format_volume failed to unmount \"%s\"\n", v->mount_point);
-        return -1;
+        return NULL;
     }
+    return v;
+}
 
+// Writes a new ext4 filesystem on v.  make_ext4fs() wipes the device
+// with a secure discard, which takes minutes on a large eMMC part; in
+// fast mode the device gets a plain discard instead, and make_ext4fs
+// only writes the metadata.  Doesn't use the UI, since it's also run
+// in children of format_volumes().
+static int format_ext4(Volume* v, int fast) {
+    if (fast) {
+        int fd = open(v->blk_device, O_RDWR);
+        if (fd >= 0) {
+            uint64_t size = 0;
+            long long len = 0;
+            if (ioctl(fd, BLKGETSIZE64, &size) == 0) {
+                // a negative length leaves room (eg for a crypto
+                // footer) at the end of the device.
+                len = v->length > 0 ? v->length : (long long) size + v->length;
+            }
+            uint64_t range[2] = { 0, (uint64_t) len };
+            if (len > 0 && (uint64_t) len <= size &&
+                ioctl(fd, BLKDISCARD, range) == 0) {
+                reset_ext4fs_info();
+                info.len = len;
+                int result = make_ext4fs_internal(fd, NULL, v->mount_point,
+                                                  NULL, 0, 0, 0, 0, sehandle, 0);
+                close(fd);
+                return result;
+            }
+            LOGW("can't discard %s (%s); doing a full wipe\n",
+                 v->blk_device, strerror(errno));
+            close(fd);
+        }
+    }
+    return make_ext4fs(v->blk_device, v->length, v->mount_point, sehandle);
+}
+
+static int format_unmounted_volume(Volume* v, int fast) {
     if (strcmp(v->fs_type, "yaffs2") == 0 || strcmp(v->fs_type, "mtd") == 0) {
         mtd_scan_partitions();
         const MtdPartition* partition = mtd_find_partition_by_name(v->blk_device);
@@ -191,7 +236,7 @@ int format_volume(const char* volume) {
     }
 
     if (strcmp(v->fs_type, "ext4") == 0) {
-        int result = make_ext4fs(v->blk_device, v->length, volume, sehandle);
+        int result = format_ext4(v, fast);
         if (result != 0) {
             LOGE("format_volume: make_extf4fs failed on %s\n", v->blk_device);
             return -1;
@@ -202,3 +247,61 @@ int format_volume(const char* volume) {
     LOGE("format_volume: fs_type \"%s\" unsupported\n", v->fs_type);
     return -1;
 }
+
+int format_volume(const char* volume) {
+    Volume* v = volume_to_format(volume);
+    if (v == NULL) {
+        return -1;
+    }
+    return format_unmounted_volume(v, 0);
+}
+
+int format_volumes(const char* const* volumes, int count, int fast) {
+    int result = 0;
+    pid_t* pids = (pid_t*) malloc(count * sizeof(pid_t));
+    if (pids == NULL) {
+        LOGE("format_volumes: out of memory\n");
+        return -1;
+    }
+
+    // make_ext4fs keeps its state in globals, so ext4 volumes are each
+    // formatted in a child process.
+    int i;
+    for (i = 0; i < count; ++i) {
+        pids[i] = -1;
+        Volume* v = volume_to_format(volumes[i]);
+        if (v == NULL) {
+            result = -1;
+            continue;
+        }
+        if (count > 1 && strcmp(v->fs_type, "ext4") == 0) {
+            fflush(stdout);
+            fflush(stderr);
+            pids[i] = fork();
+            if (pids[i] == 0) {
+                int status = format_ext4(v, fast);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(status == 0 ? 0 : 1);
+            }
+            if (pids[i] > 0) continue;
+            LOGW("format_volumes: can't fork (%s)\n", strerror(errno));
+        }
+        if (format_unmounted_volume(v, fast) != 0) {
+            result = -1;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (pids[i] <= 0) continue;
+        int status;
+        if (waitpid(pids[i], &status, 0) != pids[i] ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            LOGE("format_volume: make_extf4fs failed on %s\n",
+                 volume_for_path(volumes[i])->blk_device);
+            result = -1;
+        }
+    }
+    free(pids);
+    return result;
+}
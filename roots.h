@@ -42,6 +42,12 @@ int ensure_path_unmounted(const char* path);
 // it is mounted.
 int format_volume(const char* volume);
 
+// Reformat several volumes (mount points, as for format_volume()) at
+// once; the volumes must be on separate devices.  In fast mode, ext4
+// volumes are discarded rather than securely wiped.  Returns 0 if
+// every volume was formatted.
+int format_volumes(const char* const* volumes, int count, int fast);
+
 #ifdef __cplusplus
 }
 #endif
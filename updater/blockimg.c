@@ -0,0 +1,692 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Block-based updates: rather than mounting a filesystem and
+// rewriting it file by file, write its block device directly, in
+// order, as directed by a transfer list made when the package was
+// built.
+//
+// The transfer list is text:
+//
+//   1                        version
+//   <total blocks>           blocks written, for progress
+//   <command> ...            one per line
+//
+// where a <rangeset> is "<n>,<a1>,<b1>,...": n/2 half-open ranges of
+// 4096-byte blocks, [a1,b1) and so on.  The commands are
+//
+//   erase <rangeset>         discard the blocks (their contents are
+//                            no longer needed)
+//   zero <rangeset>          fill the blocks with zeroes
+//   new <rangeset>           fill the blocks with the next bytes of
+//                            the new data entry
+//   move <src> <tgt>         copy the blocks of <src> to <tgt>
+//   bsdiff <off> <len> <src> <tgt>
+//   imgdiff <off> <len> <src> <tgt>
+//                            apply the patch at [off, off+len) of the
+//                            patch data entry to the blocks of <src>,
+//                            writing the result to <tgt>
+//
+// The package builder orders the commands so that no command reads
+// blocks that an earlier one has written.
+//
+// Nothing here checks what the commands write: the transfer list has
+// no hashes of the sources or targets.  A run that was interrupted
+// can't simply be repeated, since its sources may already have been
+// overwritten, and a patch applied to them produces garbage without
+// any error.  The script must check the result with range_sha1()
+// (and should check the sources the same way before starting).
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "applypatch/applypatch.h"
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+
+#define BLOCKSIZE 4096
+
+typedef struct {
+    int count;          // number of ranges
+    size_t size;        // total number of blocks
+    int pos[0];         // count pairs of [start, end) block numbers
+} RangeSet;
+
+// Parse "<n>,<a1>,<b1>,...".  Returns NULL if the text is malformed.
+static RangeSet* ParseRange(const char* text) {
+    char* copy = strdup(text);
+    char* save;
+    char* token = strtok_r(copy, ",", &save);
+    long num = token ? strtol(token, NULL, 0) : 0;
+    if (num <= 0 || num % 2 != 0) {
+        free(copy);
+        return NULL;
+    }
+
+    RangeSet* out = malloc(sizeof(RangeSet) + num * sizeof(int));
+    if (out == NULL) {
+        free(copy);
+        return NULL;
+    }
+    out->count = num / 2;
+    out->size = 0;
+    int i;
+    for (i = 0; i < num; ++i) {
+        token = strtok_r(NULL, ",", &save);
+        if (token == NULL) {
+            free(out);
+            free(copy);
+            return NULL;
+        }
+        out->pos[i] = strtol(token, NULL, 0);
+        if (i % 2 == 1) {
+            if (out->pos[i] <= out->pos[i-1]) {
+                free(out);
+                free(copy);
+                return NULL;
+            }
+            out->size += out->pos[i] - out->pos[i-1];
+        }
+    }
+    free(copy);
+    return out;
+}
+
+static int ReadAll(int fd, uint8_t* data, size_t size) {
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = read(fd, data+so_far, size-so_far);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            printf("read failed: %s\n", r < 0 ? strerror(errno) : "eof");
+            return -1;
+        }
+        so_far += r;
+    }
+    return 0;
+}
+
+static int WriteAll(int fd, const uint8_t* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = write(fd, data+written, size-written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            printf("write failed: %s\n", w < 0 ? strerror(errno) : "eof");
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+}
+
+static int SeekToBlock(int fd, int block) {
+    off64_t offset = (off64_t)block * BLOCKSIZE;
+    if (lseek64(fd, offset, SEEK_SET) != offset) {
+        printf("failed to seek to block %d: %s\n", block, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Read the blocks of rs, in order, into buffer.
+static int ReadRanges(int fd, const RangeSet* rs, uint8_t* buffer) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t size = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (SeekToBlock(fd, rs->pos[i*2]) != 0 ||
+            ReadAll(fd, buffer+p, size) != 0) {
+            return -1;
+        }
+        p += size;
+    }
+    return 0;
+}
+
+// A SinkFn that writes sequentially through the blocks of a RangeSet.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int p_block;            // range being written
+    size_t p_remain;        // bytes left in it
+} RangeSinkState;
+
+static void InitRangeSink(RangeSinkState* rss, int fd, const RangeSet* tgt) {
+    rss->fd = fd;
+    rss->tgt = tgt;
+    rss->p_block = 0;
+    rss->p_remain = (size_t)(tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
+}
+
+static int RangeSinkStart(RangeSinkState* rss) {
+    return SeekToBlock(rss->fd, rss->tgt->pos[rss->p_block*2]);
+}
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size,
+                              void* token) {
+    RangeSinkState* rss = (RangeSinkState*)token;
+    ssize_t written = 0;
+    while (size > 0 && rss->p_remain > 0) {
+        size_t write_now = size;
+        if (write_now > rss->p_remain) write_now = rss->p_remain;
+        if (WriteAll(rss->fd, data, write_now) != 0) break;
+
+        data += write_now;
+        size -= write_now;
+        written += write_now;
+        rss->p_remain -= write_now;
+
+        if (rss->p_remain == 0 && ++rss->p_block < rss->tgt->count) {
+            rss->p_remain = (size_t)(rss->tgt->pos[rss->p_block*2+1] -
+                                     rss->tgt->pos[rss->p_block*2]) *
+                            BLOCKSIZE;
+            if (RangeSinkStart(rss) != 0) break;
+        }
+    }
+    return written;
+}
+
+// The new data entry is inflated on its own thread, straight into
+// whichever "new" command is running; the command waits until its
+// ranges are full.
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    RangeSinkState* rss;    // the "new" command to fill, or NULL
+    bool abort;             // the transfer is over; stop inflating
+    bool failed;            // a write failed
+} NewThreadInfo;
+
+static bool ReceiveNewData(const unsigned char* data, int size,
+                           void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*)cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->rss == NULL && !nti->abort) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        if (nti->abort) {
+            pthread_mutex_unlock(&nti->mu);
+            return false;
+        }
+        RangeSinkState* rss = nti->rss;
+        pthread_mutex_unlock(&nti->mu);
+
+        ssize_t written = RangeSinkWrite((unsigned char*)data, size, rss);
+        bool short_write = rss->p_block < rss->tgt->count &&
+                           written < size;
+
+        if (rss->p_block == rss->tgt->count || short_write) {
+            // Filled this command's ranges (or failed to); hand
+            // control back to it.
+            pthread_mutex_lock(&nti->mu);
+            nti->rss = NULL;
+            nti->failed = nti->failed || short_write;
+            pthread_cond_broadcast(&nti->cv);
+            pthread_mutex_unlock(&nti->mu);
+            if (short_write) return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+static void* UnzipNewData(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*)cookie;
+    mzProcessZipEntryContents(nti->za, nti->entry, ReceiveNewData, nti);
+
+    // Wake any "new" command still waiting; there's no more data.
+    pthread_mutex_lock(&nti->mu);
+    nti->abort = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return NULL;
+}
+
+static int ZeroRanges(int fd, const RangeSet* rs) {
+    static uint8_t zeroes[BLOCKSIZE*16];
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        // Not BLKZEROOUT: it would bypass the page cache that the
+        // other commands write through.
+        if (SeekToBlock(fd, rs->pos[i*2]) != 0) return -1;
+        size_t left = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        while (left > 0) {
+            size_t n = left < sizeof(zeroes) ? left : sizeof(zeroes);
+            if (WriteAll(fd, zeroes, n) != 0) return -1;
+            left -= n;
+        }
+    }
+    return 0;
+}
+
+static void EraseRanges(int fd, const RangeSet* rs) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        uint64_t range[2];
+        range[0] = (uint64_t)rs->pos[i*2] * BLOCKSIZE;
+        range[1] = (uint64_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (ioctl(fd, BLKDISCARD, range) != 0) {
+            // Only a hint to the device; the blocks are unused either
+            // way.
+            printf("    discard of blocks %d-%d failed: %s\n",
+                   rs->pos[i*2], rs->pos[i*2+1], strerror(errno));
+            return;
+        }
+    }
+}
+
+// Make buffer hold at least size bytes.
+static uint8_t* Reserve(uint8_t** buffer, size_t* alloc, size_t size) {
+    if (size > *alloc) {
+        free(*buffer);
+        *buffer = malloc(size);
+        *alloc = *buffer ? size : 0;
+    }
+    return *buffer;
+}
+
+// block_image_update(block_device, transfer_list, new_data, patch_data)
+//
+//    Writes block_device as directed by transfer_list (the contents
+//    of the transfer list file), taking new data and patches from the
+//    package entries named new_data and patch_data.  Returns "t" on
+//    success, and aborts the script on failure.
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    Value* blockdev_filename;
+    Value* transfer_list_value;
+    Value* new_data_fn;
+    Value* patch_data_fn;
+    bool success = false;
+
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    if (ReadValueArgs(state, argv, 4, &blockdev_filename, &transfer_list_value,
+                      &new_data_fn, &patch_data_fn) < 0) {
+        return NULL;
+    }
+
+    if (blockdev_filename->type != VAL_STRING) {
+        ErrorAbort(state, "blockdev_filename argument to %s must be string", name);
+        goto done;
+    }
+    if (transfer_list_value->type != VAL_BLOB) {
+        ErrorAbort(state, "transfer_list argument to %s must be blob", name);
+        goto done;
+    }
+    if (new_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "new_data_fn argument to %s must be string", name);
+        goto done;
+    }
+    if (patch_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "patch_data_fn argument to %s must be string", name);
+        goto done;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    FILE* cmd_pipe = ui->cmd_pipe;
+    ZipArchive* za = ui->package_zip;
+
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_fn->data);
+    if (patch_entry == NULL) {
+        ErrorAbort(state, "%s(): no %s in package", name, patch_data_fn->data);
+        goto done;
+    }
+    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_fn->data);
+    if (new_entry == NULL) {
+        ErrorAbort(state, "%s(): no %s in package", name, new_data_fn->data);
+        goto done;
+    }
+
+    // Patches are used in place if the entry is stored, which is how
+    // the package builder adds it.
+    const uint8_t* patch_start = mzGetStoredZipEntryData(za, patch_entry);
+    uint8_t* patch_copy = NULL;
+    if (patch_start == NULL) {
+        patch_copy = malloc(mzGetZipEntryUncompLen(patch_entry));
+        if (patch_copy == NULL ||
+            !mzExtractZipEntryToBuffer(za, patch_entry, patch_copy)) {
+            ErrorAbort(state, "%s(): failed to extract %s", name,
+                       patch_data_fn->data);
+            free(patch_copy);
+            goto done;
+        }
+        patch_start = patch_copy;
+    }
+    size_t patch_len = mzGetZipEntryUncompLen(patch_entry);
+
+    int fd = open(blockdev_filename->data, O_RDWR);
+    if (fd < 0) {
+        ErrorAbort(state, "%s(): failed to open %s: %s", name,
+                   blockdev_filename->data, strerror(errno));
+        free(patch_copy);
+        goto done;
+    }
+    ForgetPartitionSha1s();
+
+    NewThreadInfo nti;
+    nti.za = za;
+    nti.entry = new_entry;
+    nti.rss = NULL;
+    nti.abort = false;
+    nti.failed = false;
+    pthread_mutex_init(&nti.mu, NULL);
+    pthread_cond_init(&nti.cv, NULL);
+
+    // The transfer list may be a shared, read-only blob; parse a copy.
+    char* list = malloc(transfer_list_value->size + 1);
+    if (list == NULL) {
+        ErrorAbort(state, "%s(): failed to allocate %zd bytes for the "
+                   "transfer list", name, transfer_list_value->size + 1);
+        close(fd);
+        free(patch_copy);
+        goto done;
+    }
+    memcpy(list, transfer_list_value->data, transfer_list_value->size);
+    list[transfer_list_value->size] = '\0';
+
+    pthread_t new_data_thread;
+    if (pthread_create(&new_data_thread, NULL, UnzipNewData, &nti) != 0) {
+        ErrorAbort(state, "%s(): failed to start new data thread", name);
+        close(fd);
+        free(list);
+        free(patch_copy);
+        goto done;
+    }
+
+    uint8_t* buffer = NULL;
+    size_t buffer_alloc = 0;
+    size_t blocks_so_far = 0;
+    char* line_save;
+    char* line = strtok_r(list, "\n", &line_save);
+
+    int version = line ? strtol(line, NULL, 0) : 0;
+    line = strtok_r(NULL, "\n", &line_save);
+    long total_blocks = line ? strtol(line, NULL, 0) : 0;
+    if (version != 1 || line == NULL) {
+        ErrorAbort(state, "%s(): unexpected transfer list version %d",
+                   name, version);
+        goto finish;
+    }
+    if (total_blocks <= 0) total_blocks = 1;
+
+    for (line = strtok_r(NULL, "\n", &line_save); line != NULL;
+         line = strtok_r(NULL, "\n", &line_save)) {
+        char* word_save;
+        char* style = strtok_r(line, " ", &word_save);
+        if (style == NULL) continue;
+
+        RangeSet* src = NULL;
+        RangeSet* tgt = NULL;
+        int ok = -1;
+
+        if (strcmp(style, "erase") == 0 || strcmp(style, "zero") == 0 ||
+            strcmp(style, "new") == 0) {
+            char* word = strtok_r(NULL, " ", &word_save);
+            tgt = word ? ParseRange(word) : NULL;
+            if (tgt == NULL) {
+                printf("bad ranges in \"%s\" command\n", style);
+            } else if (style[0] == 'e') {
+                EraseRanges(fd, tgt);
+                ok = 0;
+            } else if (style[0] == 'z') {
+                printf("  zeroing %zu blocks\n", tgt->size);
+                ok = ZeroRanges(fd, tgt);
+                blocks_so_far += tgt->size;
+            } else {
+                printf("  writing %zu blocks of new data\n", tgt->size);
+                RangeSinkState rss;
+                InitRangeSink(&rss, fd, tgt);
+                if (RangeSinkStart(&rss) == 0) {
+                    pthread_mutex_lock(&nti.mu);
+                    nti.rss = &rss;
+                    pthread_cond_broadcast(&nti.cv);
+                    while (nti.rss != NULL && !nti.abort) {
+                        pthread_cond_wait(&nti.cv, &nti.mu);
+                    }
+                    ok = (nti.rss == NULL && !nti.failed) ? 0 : -1;
+                    nti.rss = NULL;
+                    pthread_mutex_unlock(&nti.mu);
+                    if (ok != 0) {
+                        printf("ran out of new data, or failed to write it\n");
+                    }
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(style, "move") == 0) {
+            char* word = strtok_r(NULL, " ", &word_save);
+            src = word ? ParseRange(word) : NULL;
+            word = strtok_r(NULL, " ", &word_save);
+            tgt = word ? ParseRange(word) : NULL;
+            if (src == NULL || tgt == NULL || src->size != tgt->size) {
+                printf("bad ranges in \"move\" command\n");
+            } else if (Reserve(&buffer, &buffer_alloc,
+                               src->size * BLOCKSIZE) != NULL) {
+                printf("  moving %zu blocks\n", src->size);
+                RangeSinkState rss;
+                InitRangeSink(&rss, fd, tgt);
+                if (ReadRanges(fd, src, buffer) == 0 &&
+                    RangeSinkStart(&rss) == 0 &&
+                    RangeSinkWrite(buffer, src->size * BLOCKSIZE, &rss) ==
+                        (ssize_t)(src->size * BLOCKSIZE)) {
+                    ok = 0;
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(style, "bsdiff") == 0 ||
+                   strcmp(style, "imgdiff") == 0) {
+            char* word = strtok_r(NULL, " ", &word_save);
+            size_t patch_offset = word ? strtoul(word, NULL, 0) : 0;
+            word = strtok_r(NULL, " ", &word_save);
+            size_t this_patch_len = word ? strtoul(word, NULL, 0) : 0;
+            word = strtok_r(NULL, " ", &word_save);
+            src = word ? ParseRange(word) : NULL;
+            word = strtok_r(NULL, " ", &word_save);
+            tgt = word ? ParseRange(word) : NULL;
+
+            if (src == NULL || tgt == NULL || this_patch_len == 0 ||
+                patch_offset > patch_len ||
+                this_patch_len > patch_len - patch_offset) {
+                printf("bad arguments to \"%s\" command\n", style);
+            } else if (Reserve(&buffer, &buffer_alloc,
+                               src->size * BLOCKSIZE) != NULL) {
+                printf("  patching %zu blocks to %zu\n", src->size, tgt->size);
+
+                Value patch_value;
+                patch_value.type = VAL_BLOB;
+                patch_value.size = this_patch_len;
+                patch_value.data = (char*)(patch_start + patch_offset);
+
+                RangeSinkState rss;
+                InitRangeSink(&rss, fd, tgt);
+
+                if (ReadRanges(fd, src, buffer) == 0 &&
+                    RangeSinkStart(&rss) == 0) {
+                    int r;
+                    if (style[0] == 'i') {
+                        r = ApplyImagePatch(buffer, src->size * BLOCKSIZE,
+                                            &patch_value, RangeSinkWrite,
+                                            &rss, NULL, NULL);
+                    } else {
+                        r = ApplyBSDiffPatch(buffer, src->size * BLOCKSIZE,
+                                             &patch_value, 0, RangeSinkWrite,
+                                             &rss, NULL);
+                    }
+                    if (r != 0) {
+                        printf("failed to apply %s patch\n", style);
+                    } else if (rss.p_block != tgt->count ||
+                               rss.p_remain != 0) {
+                        printf("%s patch didn't fill its target blocks\n",
+                               style);
+                    } else {
+                        ok = 0;
+                    }
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else {
+            printf("unknown transfer style \"%s\"\n", style);
+        }
+
+        free(src);
+        free(tgt);
+        if (ok != 0) {
+            ErrorAbort(state, "%s(): \"%s\" command failed", name, style);
+            goto finish;
+        }
+
+        fprintf(cmd_pipe, "set_progress %.4f\n",
+                (double)blocks_so_far / total_blocks);
+        fflush(cmd_pipe);
+    }
+
+    if (fsync(fd) != 0) {
+        ErrorAbort(state, "%s(): fsync of %s failed: %s", name,
+                   blockdev_filename->data, strerror(errno));
+        goto finish;
+    }
+    success = true;
+    printf("wrote %zu blocks to %s; expected %ld\n",
+           blocks_so_far, blockdev_filename->data, total_blocks);
+
+  finish:
+    pthread_mutex_lock(&nti.mu);
+    nti.abort = true;
+    pthread_cond_broadcast(&nti.cv);
+    pthread_mutex_unlock(&nti.mu);
+    pthread_join(new_data_thread, NULL);
+    pthread_mutex_destroy(&nti.mu);
+    pthread_cond_destroy(&nti.cv);
+
+    free(buffer);
+    free(list);
+    free(patch_copy);
+    close(fd);
+
+  done:
+    FreeValue(blockdev_filename);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_fn);
+    FreeValue(patch_data_fn);
+    return success ? StringValue(strdup("t")) : NULL;
+}
+
+// range_sha1(block_device, rangeset)
+//
+//    Returns the hex sha1 of the given blocks of block_device, for
+//    checking a partition before or after block_image_update().
+Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
+    Value* blockdev_filename;
+    Value* ranges;
+    const uint8_t* digest = NULL;
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    if (ReadValueArgs(state, argv, 2, &blockdev_filename, &ranges) < 0) {
+        return NULL;
+    }
+
+    if (blockdev_filename->type != VAL_STRING) {
+        ErrorAbort(state, "blockdev_filename argument to %s must be string", name);
+        goto done;
+    }
+    if (ranges->type != VAL_STRING) {
+        ErrorAbort(state, "ranges argument to %s must be string", name);
+        goto done;
+    }
+
+    RangeSet* rs = ParseRange(ranges->data);
+    if (rs == NULL) {
+        ErrorAbort(state, "%s(): bad rangeset \"%s\"", name, ranges->data);
+        goto done;
+    }
+
+    int fd = open(blockdev_filename->data, O_RDONLY);
+    if (fd < 0) {
+        ErrorAbort(state, "%s(): failed to open %s: %s", name,
+                   blockdev_filename->data, strerror(errno));
+        free(rs);
+        goto done;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    uint8_t* buffer = malloc(BLOCKSIZE * 16);
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        if (SeekToBlock(fd, rs->pos[i*2]) != 0) break;
+        size_t left = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        while (left > 0) {
+            size_t n = left < BLOCKSIZE * 16 ? left : BLOCKSIZE * 16;
+            if (ReadAll(fd, buffer, n) != 0) break;
+            SHA_update(&ctx, buffer, n);
+            left -= n;
+        }
+        if (left > 0) break;
+    }
+    if (i == rs->count) {
+        digest = SHA_final(&ctx);
+    } else {
+        ErrorAbort(state, "%s(): failed to read %s", name,
+                   blockdev_filename->data);
+    }
+    free(buffer);
+    free(rs);
+    close(fd);
+
+  done:
+    FreeValue(blockdev_filename);
+    FreeValue(ranges);
+    if (digest == NULL) {
+        return NULL;
+    }
+
+    char* hex = malloc(SHA_DIGEST_SIZE*2 + 1);
+    const char* alphabet = "0123456789abcdef";
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        hex[i*2] = alphabet[(digest[i] >> 4) & 0xf];
+        hex[i*2+1] = alphabet[digest[i] & 0xf];
+    }
+    hex[i*2] = '\0';
+    return StringValue(hex);
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+    RegisterFunction("range_sha1", RangeSha1Fn);
+}
@@ -17,9 +17,11 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,15 +29,20 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <linux/fs.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
+#include "minzip/LabelCache.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "mtdutils/partitions.h"
 #include "updater.h"
+#include "patchplan.h"
+#include "patchsched.h"
 #include "applypatch/applypatch.h"
 
 #ifdef USE_EXT4
@@ -81,7 +88,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
     char *secontext = NULL;
 
     if (sehandle) {
-        selabel_lookup(sehandle, &secontext, mount_point, 0755);
+        labelLookup(sehandle, &secontext, mount_point, 0755);
         setfscreatecon(secontext);
     }
 
@@ -93,9 +100,8 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (strcmp(partition_type, "MTD") == 0) {
-        mtd_scan_partitions();
-        const MtdPartition* mtd;
-        mtd = mtd_find_partition_by_name(location);
+        const PartitionInfo* info = partition_index_find(PARTITION_MTD, location);
+        const MtdPartition* mtd = info ? info->mtd : NULL;
         if (mtd == NULL) {
             fprintf(stderr, "%s: no mtd partition named \"%s\"",
                     name, location);
@@ -189,61 +195,48 @@ done:
 
 //add by zcl for fsg erase
 
-#define PATH_SYS_LINKED             "/sys/block/mmcblk0/"
-#define RB_MAX_PATH                 1024
-#define SECTOR_SIZE                 0x200 //512
-
 
 int get_Partition_info(char* ptname, unsigned long* byte_size) {
-    char path_byname[RB_MAX_PATH] = {'\0'};
-    char linkedpath[RB_MAX_PATH] = {'\0'};
-    char sys_path_byte_size[RB_MAX_PATH] = PATH_SYS_LINKED;
-    char pbBuffer_size[40] = {0};
-    int ret = -1;
-
-    strcpy(path_byname,ptname);
-    //the linkedpath will be (/dev/block/mmcblk0p*)
-    ret = readlink(path_byname, linkedpath, RB_MAX_PATH);
-    if (ret == -1) {
-        fprintf(stderr, "get_Partition_info error readlink %s errno = %d\n", sys_path_byte_size, errno);
-        goto GET_SIZE_DONE;
-    }
-    strcat(sys_path_byte_size, linkedpath+11);
-    strcat(sys_path_byte_size, "/size");
-
-    //open /sys/block/mmcblk0/mmcblk0p*/size
-    int fd = open(sys_path_byte_size, O_RDONLY);
-    if ( -1 == fd) {
-        fprintf(stderr, "get_Partition_info error open %s errno = %d\n", sys_path_byte_size, errno);
-        goto GET_SIZE_DONE;
+    const PartitionInfo* info = partition_index_find(PARTITION_EMMC, ptname);
+    if (info == NULL || info->size == 0) {
+        fprintf(stderr, "get_Partition_info error probing %s errno = %d\n", ptname, errno);
+        return -1;
     }
 
-    if (-1 == read(fd, pbBuffer_size, 30)) {
-        fprintf(stderr, "get_Partition_info error read %s errno = %d\n", sys_path_byte_size, errno);
-        goto GET_SIZE_DONE;
-    }
-
-    *byte_size = strtoul(pbBuffer_size,NULL,10) * SECTOR_SIZE;
+    *byte_size = info->size;
 
-    fprintf(stdout, "get_Partition_info partition : %s byte_size : %x\n",
+    fprintf(stdout, "get_Partition_info partition : %s byte_size : %lx\n",
                 ptname,  *byte_size);
-    ret = 0;
+    return 0;
+}
 
-GET_SIZE_DONE:
-    if (fd != -1)
-        close(fd);
-    return ret;
+#define ERASE_CHUNK_SIZE            (1024*1024)
 
+// Have the device zero [0, byte_size) of fd itself, rather than
+// writing the zeroes.  Discarded blocks only read back as zeroes if
+// the device says so; otherwise ask it to write zeroes.  Returns 0
+// on success.
+static int mmc_fast_erase(int fd, unsigned long byte_size) {
+    uint64_t range[2] = { 0, byte_size };
+    unsigned int zeroes = 0;
+
+    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes) {
+        if (ioctl(fd, BLKSECDISCARD, range) == 0) return 0;
+        if (ioctl(fd, BLKDISCARD, range) == 0) return 0;
+    }
+#ifdef BLKZEROOUT
+    if (ioctl(fd, BLKZEROOUT, range) == 0) return 0;
+#endif
+    return -1;
 }
 
 int mmc_raw_erase (char* partition, unsigned long byte_size ) {
-    char data[SECTOR_SIZE];
-    memset(data, 0, sizeof(data));
+    char* data = NULL;
     int fd;
     int ret = -1;
     unsigned long soFar = 0;
 
-    fprintf(stdout, "mmc_raw_erase partition : %s  byte_size : %x\n",
+    fprintf(stdout, "mmc_raw_erase partition : %s  byte_size : %lx\n",
                 partition, byte_size);
 
     fd = open (partition, O_WRONLY);
@@ -252,26 +245,25 @@ int mmc_raw_erase (char* partition, unsigned long byte_size ) {
         goto ERROR;
     }
 
-    while(soFar < byte_size){
-        int rest_size = 0;
-        rest_size = byte_size-soFar;
+    if (mmc_fast_erase(fd, byte_size) == 0) {
+        fprintf(stdout, "mmc_raw_erase done (discard)!\n");
+        ret = 0;
+        goto ERROR;
+    }
 
-        if(rest_size > SECTOR_SIZE) {
+    data = calloc(1, ERASE_CHUNK_SIZE);
+    while(soFar < byte_size){
+        unsigned long rest_size = byte_size-soFar;
+        if (rest_size > ERASE_CHUNK_SIZE) {
+            rest_size = ERASE_CHUNK_SIZE;
+        }
 
-            if ((write(fd, data, SECTOR_SIZE)) == SECTOR_SIZE){
-               soFar += SECTOR_SIZE;
-            }else{
-                fprintf(stderr, "error write %s errno = %d\n", partition, errno);
-                goto ERROR;
-            }
-        } else {
-            if ((write(fd, data, rest_size)) == rest_size){
-               soFar += rest_size;
-            }else{
-                fprintf(stderr, "error2 write %s errno = %d\n", partition, errno);
-                goto ERROR;
-            }
+        ssize_t wrote = write(fd, data, rest_size);
+        if (wrote <= 0) {
+            fprintf(stderr, "error write %s errno = %d\n", partition, errno);
+            goto ERROR;
         }
+        soFar += wrote;
     }
 
     fprintf(stdout, "mmc_raw_erase done!\n");
@@ -280,6 +272,7 @@ int mmc_raw_erase (char* partition, unsigned long byte_size ) {
     ret = 0;
 
 ERROR:
+    free(data);
     if (fd != -1)
         close(fd);
     return ret;
@@ -310,6 +303,7 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (ReadArgs(state, argv, 5, &fs_type, &partition_type, &location, &fs_size, &mount_point) < 0) {
         return NULL;
     }
+    ForgetPartitionSha1s();
 
     if (strlen(fs_type) == 0) {
         ErrorAbort(state, "fs_type argument to %s() can't be empty", name);
@@ -331,8 +325,8 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (strcmp(partition_type, "MTD") == 0) {
-        mtd_scan_partitions();
-        const MtdPartition* mtd = mtd_find_partition_by_name(location);
+        const PartitionInfo* info = partition_index_find(PARTITION_MTD, location);
+        const MtdPartition* mtd = info ? info->mtd : NULL;
         if (mtd == NULL) {
             fprintf(stderr, "%s: no mtd partition named \"%s\"",
                     name, location);
@@ -550,6 +544,8 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done2;
         }
 
+        // dest_path may be a block device.
+        ForgetPartitionSha1s();
         FILE* f = fopen(dest_path, "wb");
         if (f == NULL) {
             fprintf(stderr, "%s: can't open %s for write: %s\n",
@@ -575,7 +571,8 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
         if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
 
-        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        ZipArchive* za = ui->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
             fprintf(stderr, "%s: no %s in package\n", name, zip_path);
@@ -583,6 +580,17 @@ Value* PackageExtractFileFn(const char* name, State* state,
         }
 
         v->size = mzGetZipEntryUncompLen(entry);
+
+        // Entries stored uncompressed (as patches are) are returned in
+        // place in the mapped package, rather than copied.
+        const unsigned char* stored = mzGetStoredZipEntryData(za, entry);
+        if (stored != NULL) {
+            free(v);
+            free(zip_path);
+            return SharedBlobValue((char*)stored, mzGetZipEntryUncompLen(entry),
+                                   ui->package_storage);
+        }
+
         v->data = malloc(v->size);
         if (v->data == NULL) {
             fprintf(stderr, "%s: failed to allocate %ld bytes for %s\n",
@@ -632,14 +640,11 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
         return ErrorAbort(state, "%s() expects 1+ args, got %d", name, argc);
     }
     char* target;
-    target = Evaluate(state, argv[0]);
+    target = EvaluateTransientString(state, argv[0]);
     if (target == NULL) return NULL;
 
-    char** srcs = ReadVarArgs(state, argc-1, argv+1);
-    if (srcs == NULL) {
-        free(target);
-        return NULL;
-    }
+    char** srcs = ReadTransientVarArgs(state, argc-1, argv+1);
+    if (srcs == NULL) return NULL;
 
     int bad = 0;
     int i;
@@ -661,9 +666,7 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
                     name, srcs[i], target, strerror(errno));
             ++bad;
         }
-        free(srcs[i]);
     }
-    free(srcs);
     if (bad) {
         return ErrorAbort(state, "%s: some symlinks failed", name);
     }
@@ -681,7 +684,7 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
                           name, min_args, argc);
     }
 
-    char** args = ReadVarArgs(state, argc, argv);
+    char** args = ReadTransientVarArgs(state, argc, argv);
     if (args == NULL) return NULL;
 
     char* end;
@@ -724,15 +727,21 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
+        DirPermission* perms = AllocTransient((argc-3) * sizeof(DirPermission));
         for (i = 3; i < argc; ++i) {
-            if (chown(args[i], uid, gid) < 0) {
-                fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
-                        name, args[i], uid, gid, strerror(errno));
-                ++bad;
-            }
-            if (chmod(args[i], mode) < 0) {
-                fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
-                        name, args[i], mode, strerror(errno));
+            DirPermission* p = perms + (i-3);
+            p->path = args[i];
+            p->uid = uid;
+            p->gid = gid;
+            p->mode = mode;
+            p->recursive = false;
+        }
+        if (dirSetPermissions(perms, argc-3) > 0) {
+            for (i = 0; i < argc-3; ++i) {
+                if (perms[i].error == 0) continue;
+                fprintf(stderr, "%s: chown/chmod of %s to %d %d %o failed: %s\n",
+                        name, perms[i].path, uid, gid, mode,
+                        strerror(perms[i].error));
                 ++bad;
             }
         }
@@ -740,11 +749,6 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = strdup("");
 
 done:
-    for (i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
-    free(args);
-
     if (bad) {
         free(result);
         return ErrorAbort(state, "%s: some changes failed", name);
@@ -753,6 +757,109 @@ done:
 }
 
 
+// set_perm_batch(list)
+//
+// Does the work of many set_perm() and set_perm_recursive() calls at
+// once.  list (a string or a blob, eg from package_extract_file) has
+// one record per line:
+//
+//   set_perm <uid> <gid> <mode> <path>
+//   set_perm_recursive <uid> <gid> <dirmode> <filemode> <path>
+//
+// Blank lines and lines starting with '#' are ignored.  Listing files
+// in the same directory together lets it open the directory once for
+// all of them.  As with the individual functions, failures of
+// set_perm records abort the script; set_perm_recursive failures are
+// only logged.
+Value* SetPermBatchFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    Value* list = EvaluateTransient(state, argv[0]);
+    if (list == NULL) return NULL;
+
+    // Copy the list, since a blob may point into the read-only package.
+    char* text = AllocTransient(list->size + 1);
+    memcpy(text, list->data, list->size);
+    text[list->size] = '\0';
+
+    int lines = 1;
+    char* p;
+    for (p = text; *p; ++p) {
+        if (*p == '\n') ++lines;
+    }
+    DirPermission* perms = AllocTransient(lines * sizeof(DirPermission));
+    int count = 0;
+
+    int line_number = 0;
+    char* line = text;
+    while (line != NULL) {
+        char* next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        ++line_number;
+
+        char* save;
+        char* keyword = strtok_r(line, " \t\r", &save);
+        line = next;
+        if (keyword == NULL || keyword[0] == '#') continue;
+
+        DirPermission* perm = perms + count;
+        perm->recursive = (strcmp(keyword, "set_perm_recursive") == 0);
+        if (!perm->recursive && strcmp(keyword, "set_perm") != 0) {
+            return ErrorAbort(state, "%s: line %d: unknown record \"%s\"",
+                              name, line_number, keyword);
+        }
+
+        int fields[4];
+        int field_count = perm->recursive ? 4 : 3;
+        int i;
+        for (i = 0; i < field_count; ++i) {
+            char* field = strtok_r(NULL, " \t\r", &save);
+            char* end;
+            if (field == NULL) {
+                return ErrorAbort(state, "%s: line %d: too few fields",
+                                  name, line_number);
+            }
+            fields[i] = strtoul(field, &end, 0);
+            if (*end != '\0') {
+                return ErrorAbort(state, "%s: line %d: \"%s\" not a number",
+                                  name, line_number, field);
+            }
+        }
+        // The path is the rest of the line, so it may contain spaces.
+        char* path = strtok_r(NULL, "\r", &save);
+        while (path != NULL && (*path == ' ' || *path == '\t')) ++path;
+        if (path == NULL || *path == '\0') {
+            return ErrorAbort(state, "%s: line %d: no path", name, line_number);
+        }
+        perm->path = path;
+        perm->uid = fields[0];
+        perm->gid = fields[1];
+        if (perm->recursive) {
+            perm->dirMode = fields[2];
+            perm->mode = fields[3];
+        } else {
+            perm->mode = fields[2];
+        }
+        ++count;
+    }
+
+    int bad = 0;
+    if (dirSetPermissions(perms, count) > 0) {
+        int i;
+        for (i = 0; i < count; ++i) {
+            if (perms[i].error == 0) continue;
+            fprintf(stderr, "%s: setting permissions of %s failed: %s\n",
+                    name, perms[i].path, strerror(perms[i].error));
+            if (!perms[i].recursive) ++bad;
+        }
+    }
+    if (bad) {
+        return ErrorAbort(state, "%s: some changes failed", name);
+    }
+    return StringValue(strdup(""));
+}
+
 Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 1) {
         return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
@@ -876,13 +983,167 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
+#define EMMC_WRITE_CHUNK (1024*1024)
+
+// Writes an image to a block device in large aligned chunks, hashing
+// it on the way.
+typedef struct {
+    int fd;
+    bool direct;            // fd is O_DIRECT, so writes must be aligned
+    unsigned char* buffer;  // EMMC_WRITE_CHUNK bytes
+    size_t used;
+    size_t total;
+    SHA_CTX sha_ctx;
+} EmmcWriter;
+
+static bool emmc_flush(EmmcWriter* w) {
+    size_t done = 0;
+    while (done < w->used) {
+        ssize_t wrote = write(w->fd, w->buffer + done, w->used - done);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            return false;
+        }
+        done += wrote;
+    }
+    w->used = 0;
+    return true;
+}
+
+static bool write_emmc_image_cb(const unsigned char* data,
+                                int data_len, void* cookie) {
+    EmmcWriter* w = (EmmcWriter*)cookie;
+    SHA_update(&w->sha_ctx, data, data_len);
+    w->total += data_len;
+    while (data_len > 0) {
+        size_t n = EMMC_WRITE_CHUNK - w->used;
+        if (n > (size_t)data_len) n = data_len;
+        memcpy(w->buffer + w->used, data, n);
+        w->used += n;
+        data += n;
+        data_len -= n;
+        if (w->used == EMMC_WRITE_CHUNK && !emmc_flush(w)) return false;
+    }
+    return true;
+}
+
+// Write an image to the block device of "EMMC:<device>" partition,
+// from the package entry if there is one, else from contents (a blob
+// or a filename).  Once written, the image's hash is remembered for
+// later checks of the partition.
+static bool WriteEmmcImage(const char* name, const char* partition,
+                           ZipArchive* za, const ZipEntry* entry,
+                           Value* contents) {
+    const char* device = partition + strlen("EMMC:");
+    const PartitionInfo* info = partition_index_find(PARTITION_EMMC, device);
+    size_t image_size = entry != NULL ? (size_t)mzGetZipEntryUncompLen(entry) :
+                        contents->type == VAL_BLOB ? (size_t)contents->size : 0;
+    if (info != NULL && info->size > 0 && image_size > info->size) {
+        fprintf(stderr, "%s: %zu-byte image doesn't fit in %s (%llu bytes)\n",
+                name, image_size, device, info->size);
+        return false;
+    }
+
+    EmmcWriter w;
+    w.used = 0;
+    w.total = 0;
+    SHA_init(&w.sha_ctx);
+
+    ForgetPartitionSha1s();
+    w.direct = true;
+    w.fd = open(device, O_WRONLY | O_DIRECT);
+    if (w.fd < 0) {
+        w.direct = false;
+        w.fd = open(device, O_WRONLY);
+    }
+    if (w.fd < 0) {
+        fprintf(stderr, "%s: can't open %s: %s\n",
+                name, device, strerror(errno));
+        return false;
+    }
+    if (posix_memalign((void**)&w.buffer, 4096, EMMC_WRITE_CHUNK) != 0) {
+        close(w.fd);
+        return false;
+    }
+
+    bool success;
+    if (entry != NULL) {
+        success = mzProcessZipEntryContents(za, entry, write_emmc_image_cb, &w);
+    } else if (contents->type == VAL_STRING) {
+        // we're given a filename as the contents
+        FILE* f = fopen(contents->data, "rb");
+        if (f == NULL) {
+            fprintf(stderr, "%s: can't open %s: %s\n",
+                    name, contents->data, strerror(errno));
+            success = false;
+        } else {
+            success = true;
+            unsigned char* buffer = malloc(EMMC_WRITE_CHUNK);
+            size_t read;
+            while (success &&
+                   (read = fread(buffer, 1, EMMC_WRITE_CHUNK, f)) > 0) {
+                success = write_emmc_image_cb(buffer, read, &w);
+            }
+            free(buffer);
+            fclose(f);
+        }
+    } else {
+        success = write_emmc_image_cb((unsigned char*)contents->data,
+                                      contents->size, &w);
+    }
+
+    // The tail needn't be a multiple of the device's block size.
+    if (success && w.direct && w.used % 4096 != 0) {
+        fcntl(w.fd, F_SETFL, fcntl(w.fd, F_GETFL) & ~O_DIRECT);
+    }
+    if (success) {
+        success = emmc_flush(&w) && fsync(w.fd) == 0;
+    }
+    if (!success) {
+        fprintf(stderr, "%s: failed to write %s: %s\n",
+                name, device, strerror(errno));
+    }
+    close(w.fd);
+    free(w.buffer);
+
+    if (success) {
+        CachePartitionSha1(partition, w.total, SHA_final(&w.sha_ctx));
+    }
+    return success;
+}
+
 // write_raw_image(filename_or_blob, partition)
+//
+//    partition is an MTD partition name, or "EMMC:<device>" for a
+//    block device.  If filename_or_blob is package_extract_file("<entry>")
+//    the entry is inflated straight into the partition rather than
+//    held in memory first.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
-    Value* partition_value;
-    Value* contents;
-    if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+
+    // The arguments are evaluated in order, as ReadValueArgs() would.
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = NULL;
+    Value* contents = NULL;
+    if (argv[0]->fn == PackageExtractFileFn && argv[0]->argc == 1 &&
+        argv[0]->argv[0]->fn == Literal) {
+        entry = mzFindZipEntry(za, argv[0]->argv[0]->name);
+    }
+    if (entry == NULL) {
+        contents = EvaluateValue(state, argv[0]);
+        if (contents == NULL) {
+            return NULL;
+        }
+    }
+
+    Value* partition_value = EvaluateValue(state, argv[1]);
+    if (partition_value == NULL) {
+        FreeValue(contents);
         return NULL;
     }
 
@@ -896,19 +1157,31 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         ErrorAbort(state, "partition argument to %s can't be empty", name);
         goto done;
     }
-    if (contents->type == VAL_STRING && strlen((char*) contents->data) == 0) {
+    if (contents != NULL && contents->type == VAL_STRING &&
+        strlen((char*) contents->data) == 0) {
         ErrorAbort(state, "file argument to %s can't be empty", name);
         goto done;
     }
 
-    mtd_scan_partitions();
-    const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+    bool success;
+
+    if (strncmp(partition, "EMMC:", 5) == 0) {
+        success = WriteEmmcImage(name, partition, za, entry, contents);
+        printf("%s %s partition\n",
+               success ? "wrote" : "failed to write", partition);
+        result = success ? partition : strdup("");
+        goto done;
+    }
+
+    const PartitionInfo* info = partition_index_find(PARTITION_MTD, partition);
+    const MtdPartition* mtd = info ? info->mtd : NULL;
     if (mtd == NULL) {
         fprintf(stderr, "%s: no mtd partition named \"%s\"\n", name, partition);
         result = strdup("");
         goto done;
     }
 
+    ForgetPartitionSha1s();
     MtdWriteContext* ctx = mtd_write_partition(mtd);
     if (ctx == NULL) {
         fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
@@ -917,9 +1190,9 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    bool success;
-
-    if (contents->type == VAL_STRING) {
+    if (entry != NULL) {
+        success = mzProcessZipEntryContents(za, entry, write_raw_image_cb, ctx);
+    } else if (contents->type == VAL_STRING) {
         // we're given a filename as the contents
         char* filename = contents->data;
         FILE* f = fopen(filename, "rb");
@@ -970,6 +1243,8 @@ done:
 // apply_patch_space(bytes)
 Value* ApplyPatchSpaceFn(const char* name, State* state,
                          int argc, Expr* argv[]) {
+    PlanPatches(state);
+
     char* bytes_str;
     if (ReadArgs(state, argv, 1, &bytes_str) < 0) {
         return NULL;
@@ -996,66 +1271,19 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
                           name, argc);
     }
 
-    char* source_filename;
-    char* target_filename;
-    char* target_sha1;
-    char* target_size_str;
-    if (ReadArgs(state, argv, 4, &source_filename, &target_filename,
-                 &target_sha1, &target_size_str) < 0) {
-        return NULL;
-    }
+    PlanPatches(state);
 
-    char* endptr;
-    size_t target_size = strtol(target_size_str, &endptr, 10);
-    if (target_size == 0 && endptr == target_size_str) {
-        ErrorAbort(state, "%s(): can't parse \"%s\" as byte count",
-                   name, target_size_str);
-        free(source_filename);
-        free(target_filename);
-        free(target_sha1);
-        free(target_size_str);
+    PatchArgs args;
+    if (ReadPatchArgs(name, state, argc, argv, &args) != 0) {
         return NULL;
     }
 
-    int patchcount = (argc-4) / 2;
-    Value** patches = ReadValueVarArgs(state, argc-4, argv+4);
+    int result = applypatch(args.source_filename, args.target_filename,
+                            args.target_sha1, args.target_size,
+                            args.patchcount, args.patch_sha_str,
+                            args.patches, NULL);
 
-    int i;
-    for (i = 0; i < patchcount; ++i) {
-        if (patches[i*2]->type != VAL_STRING) {
-            ErrorAbort(state, "%s(): sha-1 #%d is not string", name, i);
-            break;
-        }
-        if (patches[i*2+1]->type != VAL_BLOB) {
-            ErrorAbort(state, "%s(): patch #%d is not blob", name, i);
-            break;
-        }
-    }
-    if (i != patchcount) {
-        for (i = 0; i < patchcount*2; ++i) {
-            FreeValue(patches[i]);
-        }
-        free(patches);
-        return NULL;
-    }
-
-    char** patch_sha_str = malloc(patchcount * sizeof(char*));
-    for (i = 0; i < patchcount; ++i) {
-        patch_sha_str[i] = patches[i*2]->data;
-        patches[i*2]->data = NULL;
-        FreeValue(patches[i*2]);
-        patches[i] = patches[i*2+1];
-    }
-
-    int result = applypatch(source_filename, target_filename,
-                            target_sha1, target_size,
-                            patchcount, patch_sha_str, patches, NULL);
-
-    for (i = 0; i < patchcount; ++i) {
-        FreeValue(patches[i]);
-    }
-    free(patch_sha_str);
-    free(patches);
+    FreePatchArgs(&args);
 
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
@@ -1073,6 +1301,8 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
                           name, argc);
     }
 
+    PlanPatches(state);
+
     char* filename;
     if (ReadArgs(state, argv, 1, &filename) < 0) {
         return NULL;
@@ -1169,6 +1399,11 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fprintf(stderr, "about to run program [%s] with %d args\n", args2[0], argc);
 
+    // The program may write partitions behind our back, or change
+    // them.
+    ForgetPartitionSha1s();
+    partition_index_refresh();
+
     pid_t child = fork();
     if (child == 0) {
         execv(args2[0], args2);
@@ -1221,23 +1456,45 @@ static char* PrintSha1(uint8_t* digest) {
 //    returns the sha1 of the file if it matches any of the hex
 //    strings passed, or "" if it does not equal any of them.
 //
+Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]);
+
 Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc < 1) {
         return ErrorAbort(state, "%s() expects at least 1 arg", name);
     }
 
-    Value** args = ReadValueVarArgs(state, argc, argv);
-    if (args == NULL) {
-        return NULL;
-    }
+    // For sha1_check(read_file("<path>"), ...) the file needn't be
+    // read if its hash is already known.
+    uint8_t digest[SHA_DIGEST_SIZE];
+    Value** args;
+    if (argv[0]->fn == ReadFileFn && argv[0]->argc == 1 &&
+        argv[0]->argv[0]->fn == Literal &&
+        GetCachedFileSha1(argv[0]->argv[0]->name, RETOUCH_DONT_MASK,
+                          digest) == 0) {
+        if (argc == 1) {
+            return StringValue(PrintSha1(digest));
+        }
+        Value** rest = ReadValueVarArgs(state, argc-1, argv+1);
+        if (rest == NULL) {
+            return NULL;
+        }
+        args = malloc(argc * sizeof(Value*));
+        args[0] = NULL;
+        memcpy(args+1, rest, (argc-1) * sizeof(Value*));
+        free(rest);
+    } else {
+        args = ReadValueVarArgs(state, argc, argv);
+        if (args == NULL) {
+            return NULL;
+        }
 
-    if (args[0]->size < 0) {
-        fprintf(stderr, "%s(): no file contents received", name);
-        return StringValue(strdup(""));
+        if (args[0]->size < 0) {
+            fprintf(stderr, "%s(): no file contents received", name);
+            return StringValue(strdup(""));
+        }
+        SHA(args[0]->data, args[0]->size, digest);
+        FreeValue(args[0]);
     }
-    uint8_t digest[SHA_DIGEST_SIZE];
-    SHA(args[0]->data, args[0]->size, digest);
-    FreeValue(args[0]);
 
     if (argc == 1) {
         return StringValue(PrintSha1(digest));
@@ -1392,6 +1649,7 @@ void RegisterInstallFunctions() {
     RegisterFunction("symlink", SymlinkFn);
     RegisterFunction("set_perm", SetPermFn);
     RegisterFunction("set_perm_recursive", SetPermFn);
+    RegisterFunction("set_perm_batch", SetPermBatchFn);
 
     RegisterFunction("getprop", GetPropFn);
     RegisterFunction("file_getprop", FileGetPropFn);
@@ -1400,6 +1658,7 @@ void RegisterInstallFunctions() {
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
+    RegisterFunction("parallel_apply_patch", ParallelApplyPatchFn);
 
     RegisterFunction("read_file", ReadFileFn);
     RegisterFunction("sha1_check", Sha1CheckFn);
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "applypatch/applypatch.h"
+#include "updater.h"
+#include "patchplan.h"
+
+typedef struct {
+    const char* source;
+    const char* target;
+    size_t source_size;
+    size_t target_size;
+    size_t patch_size;      // the patch blobs' memory, all held at once
+    int partition_target;
+    int conditional;        // nonzero if the script might not run it
+} PlannedPatch;
+
+typedef struct {
+    char* name;             // top-level directory, eg "/system"
+    long long free_space;
+} PlannedFs;
+
+static Expr* script_root = NULL;
+static int planned = 0;
+
+void SetPatchPlanScript(Expr* root) {
+    script_root = root;
+}
+
+static const char* LiteralArg(Expr* e) {
+    return (e->fn == Literal) ? e->name : NULL;
+}
+
+// The memory taken by a patch argument that is a package_extract_file()
+// of a literal path, or -1 if it can't be told without evaluating it.
+// Stored entries are used in place in the mapped package.
+static long long PatchArgSize(ZipArchive* za, Expr* e) {
+    if (e->fn == Literal || strcmp(e->name, "package_extract_file") != 0 ||
+        e->argc != 1 || LiteralArg(e->argv[0]) == NULL) {
+        return -1;
+    }
+    const ZipEntry* entry = mzFindZipEntry(za, LiteralArg(e->argv[0]));
+    if (entry == NULL) return -1;
+    if (mzGetStoredZipEntryData(za, entry) != NULL) return 0;
+    return mzGetZipEntryUncompLen(entry);
+}
+
+// Whether target already has the sha1 given by the string target_sha1,
+// ie an interrupted install got as far as patching it.  applypatch()
+// returns early for such a target, so it needs no space at all.  The
+// hash is cached, so the check costs the later apply_patch() nothing.
+static int AlreadyPatched(const char* target, const char* target_sha1) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    if (ParseSha1(target_sha1, sha1) != 0) return 0;
+    FileContents fc;
+    if (LoadFileContents(target, &fc, RETOUCH_DO_MASK) != 0) return 0;
+    int same = memcmp(fc.sha1, sha1, SHA_DIGEST_SIZE) == 0;
+    free(fc.data);
+    return same;
+}
+
+static void AddPlannedPatch(ZipArchive* za, Expr* e, int conditional,
+                            PlannedPatch** patches, int* count, int* alloc,
+                            int* unplanned, int* done) {
+    const char* source = LiteralArg(e->argv[0]);
+    const char* target = LiteralArg(e->argv[1]);
+    const char* target_sha1 = LiteralArg(e->argv[2]);
+    const char* target_size = LiteralArg(e->argv[3]);
+    if (source == NULL || target == NULL || target_sha1 == NULL ||
+        target_size == NULL) {
+        ++*unplanned;
+        return;
+    }
+    if (strcmp(target, "-") == 0) {
+        target = source;
+    }
+    if (AlreadyPatched(target, target_sha1)) {
+        ++*done;
+        return;
+    }
+
+    PlannedPatch p;
+    p.source = source;
+    p.target = target;
+    p.target_size = strtoul(target_size, NULL, 10);
+    p.partition_target = IsPartition(target);
+    p.conditional = conditional;
+
+    if (IsPartition(source)) {
+        p.source_size = LargestPartitionSize(source);
+    } else {
+        struct stat st;
+        p.source_size = (stat(source, &st) == 0) ? st.st_size : 0;
+    }
+
+    p.patch_size = 0;
+    int i;
+    for (i = 5; i < e->argc; i += 2) {
+        long long size = PatchArgSize(za, e->argv[i]);
+        if (size >= 0) p.patch_size += size;
+    }
+
+    if (*count == *alloc) {
+        *alloc = *alloc * 2 + 16;
+        *patches = realloc(*patches, *alloc * sizeof(PlannedPatch));
+    }
+    (*patches)[(*count)++] = p;
+}
+
+// Collect the apply_patch() calls in the tree, in the order they'd be
+// evaluated.  Calls in the branches of an if or on the right side of
+// && or || are marked as conditional.
+static void CollectPatches(ZipArchive* za, Expr* e, int conditional,
+                           PlannedPatch** patches, int* count, int* alloc,
+                           int* unplanned, int* done) {
+    if (e->fn == Literal) return;
+
+    if (strcmp(e->name, "apply_patch") == 0) {
+        if (e->argc >= 6) {
+            AddPlannedPatch(za, e, conditional, patches, count, alloc,
+                            unplanned, done);
+        }
+        return;
+    }
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        int cond = conditional ||
+            (e->fn == IfElseFn && i > 0) ||
+            ((e->fn == LogicalAndFn || e->fn == LogicalOrFn) && i > 0);
+        CollectPatches(za, e->argv[i], cond, patches, count, alloc,
+                       unplanned, done);
+    }
+}
+
+static PlannedFs* FindFs(PlannedFs** fss, int* count, const char* target) {
+    // Assume the target is on the same filesystem as its top-level
+    // directory, as applypatch() does.
+    size_t len = strlen(target);
+    const char* slash = strchr(target+1, '/');
+    if (slash != NULL) len = slash - target;
+
+    int i;
+    for (i = 0; i < *count; ++i) {
+        if (strlen((*fss)[i].name) == len &&
+            strncmp((*fss)[i].name, target, len) == 0) {
+            return *fss + i;
+        }
+    }
+
+    *fss = realloc(*fss, (*count+1) * sizeof(PlannedFs));
+    PlannedFs* fs = *fss + (*count)++;
+    fs->name = strndup(target, len);
+    size_t free_space = FreeSpaceForFile(fs->name);
+    fs->free_space = (free_space == (size_t)-1) ? 0 : free_space;
+    return fs;
+}
+
+void PlanPatches(State* state) {
+    if (planned || script_root == NULL) return;
+    planned = 1;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+
+    PlannedPatch* patches = NULL;
+    int count = 0;
+    int alloc = 0;
+    int unplanned = 0;
+    int done = 0;
+    CollectPatches(za, script_root, 0, &patches, &count, &alloc, &unplanned,
+                   &done);
+    if (count == 0) {
+        if (done > 0) {
+            printf("plan: all %d planned apply_patch calls already done\n",
+                   done);
+        }
+        free(patches);
+        return;
+    }
+
+    // Go through the patches in order, tracking the free space on each
+    // target filesystem.  A patch whose filesystem is short of space
+    // will have its source backed up to /cache and deleted, as will
+    // every patch of a partition.
+    PlannedFs* fss = NULL;
+    int fs_count = 0;
+    size_t cache_needed = 0;
+    size_t cache_needed_always = 0;   // by patches that always run
+    size_t ram_needed = 0;
+    int fallbacks = 0;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        PlannedPatch* p = patches + i;
+
+        size_t ram = p->source_size + p->patch_size;
+        if (p->partition_target) ram += p->target_size;
+        if (ram > ram_needed) ram_needed = ram;
+
+        int backup = p->partition_target;
+        if (!p->partition_target) {
+            PlannedFs* fs = FindFs(&fss, &fs_count, p->target);
+            long long wanted = (long long)p->target_size * 3 / 2;
+            if (wanted < MIN_TARGET_FREE) wanted = MIN_TARGET_FREE;
+            if (fs->free_space <= wanted) {
+                printf("plan: %s will be patched via /cache "
+                       "(%lld bytes free on %s, %lld wanted)\n",
+                       p->target, fs->free_space, fs->name, wanted);
+                backup = 1;
+                ++fallbacks;
+            }
+            fs->free_space -= p->target_size;
+            if (strcmp(p->source, p->target) == 0) {
+                fs->free_space += p->source_size;
+            }
+        }
+
+        if (backup) {
+            if (p->source_size > cache_needed) {
+                cache_needed = p->source_size;
+            }
+            if (!p->conditional && p->source_size > cache_needed_always) {
+                cache_needed_always = p->source_size;
+            }
+        }
+    }
+
+    printf("plan: %d apply_patch calls (%d already done, %d with "
+           "non-literal arguments not planned)\n", count, done, unplanned);
+    printf("plan: peak RAM %ld bytes", (long)ram_needed);
+    struct sysinfo si;
+    if (sysinfo(&si) == 0) {
+        printf(" (%ld available)",
+               (long)((si.freeram + si.bufferram) * (unsigned long long)si.mem_unit));
+    }
+    printf("\n");
+    printf("plan: peak /cache %ld bytes; %d patches need the /cache fallback\n",
+           (long)cache_needed, fallbacks);
+    for (i = 0; i < fs_count; ++i) {
+        printf("plan: %s ends with %lld bytes free\n",
+               fss[i].name, fss[i].free_space);
+        free(fss[i].name);
+    }
+    free(fss);
+    free(patches);
+
+    // Make room on /cache now for the patches the script always runs
+    // (each of which would do the same when it got there).  The plan
+    // is only an estimate, so a shortfall is left for the apply_patch()
+    // calls themselves to report.
+    if (cache_needed_always > 0 &&
+        MakeFreeSpaceOnCache(cache_needed_always) < 0) {
+        printf("plan: warning: can't make %ld bytes available on /cache\n",
+               (long)cache_needed_always);
+    } else if (cache_needed > cache_needed_always) {
+        printf("plan: conditional patches may need %ld bytes on /cache\n",
+               (long)cache_needed);
+    }
+}
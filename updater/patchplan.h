@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PATCHPLAN_H_
+#define _UPDATER_PATCHPLAN_H_
+
+#include "edify/expr.h"
+
+// Remember the root of the parsed script, for PlanPatches().
+void SetPatchPlanScript(Expr* root);
+
+// The first time it's called, walk the whole script for apply_patch()
+// calls whose arguments are literals and whose targets aren't already
+// patched, work out how much /cache, target filesystem and RAM space
+// they will need, and report that.  Makes the /cache space needed by
+// the patches the script always runs available up front.  The plan is
+// advisory: it never fails the script.
+void PlanPatches(State* state);
+
+#endif
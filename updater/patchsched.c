@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * parallel_apply_patch() runs the apply_patch() calls among its
+ * arguments on worker threads, while keeping the result the script
+ * would get from evaluating them one after another:
+ *
+ *   - The arguments of each call (the patch blobs, usually) are
+ *     evaluated on the main thread, in order.
+ *
+ *   - Results are taken in script order.  A failed call's "|| expr"
+ *     is evaluated when its turn comes, and if that aborts, nothing
+ *     after it is evaluated.  Once any call has failed, no new calls
+ *     are started until the failure has been dealt with.
+ *
+ *   - A call only goes to a worker if it can't get in the way of the
+ *     calls already running: it doesn't share a source or target
+ *     with them, its filesystem looks to have room for its target on
+ *     top of theirs, and the total memory estimate stays within a
+ *     budget.  Otherwise it waits its turn and runs on the main
+ *     thread with nothing else running, as do calls involving
+ *     partitions.
+ *
+ *   - Workers never use the /cache copy of the source, which there is
+ *     only one of.  A call that turns out to need it (because the
+ *     space ran short after all, or its source is bad) gives up
+ *     without touching its target, and is run again on the main
+ *     thread, with nothing else running, when its turn comes.
+ *
+ *   - Progress is reported, in order, as each argument is finished.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "applypatch/applypatch.h"
+#include "updater.h"
+#include "patchplan.h"
+#include "patchsched.h"
+
+int ReadPatchArgs(const char* name, State* state, int argc, Expr* argv[],
+                  PatchArgs* args) {
+    char* target_size_str;
+    if (ReadArgs(state, argv, 4, &args->source_filename,
+                 &args->target_filename, &args->target_sha1,
+                 &target_size_str) < 0) {
+        return -1;
+    }
+
+    char* endptr;
+    args->target_size = strtol(target_size_str, &endptr, 10);
+    if (args->target_size == 0 && endptr == target_size_str) {
+        ErrorAbort(state, "%s(): can't parse \"%s\" as byte count",
+                   name, target_size_str);
+        free(args->source_filename);
+        free(args->target_filename);
+        free(args->target_sha1);
+        free(target_size_str);
+        return -1;
+    }
+    free(target_size_str);
+
+    int patchcount = (argc-4) / 2;
+    Value** patches = ReadValueVarArgs(state, argc-4, argv+4);
+    if (patches == NULL) {
+        free(args->source_filename);
+        free(args->target_filename);
+        free(args->target_sha1);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < patchcount; ++i) {
+        if (patches[i*2]->type != VAL_STRING) {
+            ErrorAbort(state, "%s(): sha-1 #%d is not string", name, i);
+            break;
+        }
+        if (patches[i*2+1]->type != VAL_BLOB) {
+            ErrorAbort(state, "%s(): patch #%d is not blob", name, i);
+            break;
+        }
+    }
+    if (i != patchcount) {
+        for (i = 0; i < patchcount*2; ++i) {
+            FreeValue(patches[i]);
+        }
+        free(patches);
+        free(args->source_filename);
+        free(args->target_filename);
+        free(args->target_sha1);
+        return -1;
+    }
+
+    char** patch_sha_str = malloc(patchcount * sizeof(char*));
+    for (i = 0; i < patchcount; ++i) {
+        patch_sha_str[i] = patches[i*2]->data;
+        patches[i*2]->data = NULL;
+        FreeValue(patches[i*2]);
+        patches[i] = patches[i*2+1];
+    }
+
+    args->patchcount = patchcount;
+    args->patch_sha_str = patch_sha_str;
+    args->patches = patches;
+    return 0;
+}
+
+void FreePatchArgs(PatchArgs* args) {
+    int i;
+    for (i = 0; i < args->patchcount; ++i) {
+        free(args->patch_sha_str[i]);
+        FreeValue(args->patches[i]);
+    }
+    free(args->patch_sha_str);
+    free(args->patches);
+    free(args->source_filename);
+    free(args->target_filename);
+    free(args->target_sha1);
+}
+
+typedef enum { TASK_WAITING, TASK_RUNNING, TASK_DONE } TaskState;
+
+struct Scheduler;
+
+typedef struct {
+    Expr* call;             // the apply_patch() call, or NULL
+    Expr* on_failure;       // right side of "apply_patch(...) || expr"
+
+    int prepared;           // args have been evaluated (or failed to)
+    char* errmsg;           // non-NULL if evaluating the args failed
+    PatchArgs args;
+    const char* target;     // target filename, with "-" resolved
+    char* target_fs;        // top-level directory of the target
+    int partition;          // source or target is a partition
+    size_t memory;          // estimated peak memory use
+
+    TaskState state;
+    int result;
+    pthread_t thread;
+    struct Scheduler* sched;
+} PatchTask;
+
+typedef struct Scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // signalled whenever a task finishes
+    int running;
+    int failures;           // finished, failed and not yet resolved
+    size_t memory_in_use;
+} Scheduler;
+
+static int IsPatchCall(Expr* e) {
+    return e->fn != Literal && strcmp(e->name, "apply_patch") == 0 &&
+           e->argc >= 6 && (e->argc % 2) == 0;
+}
+
+static void SetUpTask(PatchTask* t, Expr* e, Scheduler* sched) {
+    memset(t, 0, sizeof(*t));
+    t->state = TASK_WAITING;
+    t->sched = sched;
+    if (IsPatchCall(e)) {
+        t->call = e;
+    } else if (e->fn == LogicalOrFn && IsPatchCall(e->argv[0])) {
+        t->call = e->argv[0];
+        t->on_failure = e->argv[1];
+    }
+}
+
+// Evaluate the task's arguments (on the main thread) and work out
+// what it needs to run.  An evaluation error is saved in the task
+// rather than left in state, since earlier calls haven't been
+// resolved yet.
+static void PrepareTask(State* state, PatchTask* t) {
+    t->prepared = 1;
+    if (ReadPatchArgs(t->call->name, state, t->call->argc,
+                      t->call->argv, &t->args) != 0) {
+        t->errmsg = state->errmsg ? state->errmsg : strdup("");
+        state->errmsg = NULL;
+        return;
+    }
+
+    const char* source = t->args.source_filename;
+    t->target = t->args.target_filename;
+    if (strcmp(t->target, "-") == 0) {
+        t->target = source;
+    }
+    t->partition = IsPartition(source) || IsPartition(t->target);
+
+    size_t len = strlen(t->target);
+    const char* slash = strchr(t->target+1, '/');
+    if (slash != NULL) len = slash - t->target;
+    t->target_fs = strndup(t->target, len);
+
+    // applypatch() holds the source, the patches and the decoded
+    // chunks of the target in memory at once.  (Patches that point
+    // into the mapped package take no memory of their own.)
+    struct stat st;
+    t->memory = t->args.target_size;
+    if (!IsPartition(source) && stat(source, &st) == 0) {
+        t->memory += st.st_size;
+    }
+    int i;
+    for (i = 0; i < t->args.patchcount; ++i) {
+        if (FindValueStorage(t->args.patches[i]->data) == NULL) {
+            t->memory += t->args.patches[i]->size;
+        }
+    }
+}
+
+static void FreeTask(PatchTask* t) {
+    if (t->prepared && t->errmsg == NULL) {
+        FreePatchArgs(&t->args);
+    }
+    free(t->errmsg);
+    free(t->target_fs);
+    t->prepared = 0;
+    t->errmsg = NULL;
+    t->target_fs = NULL;
+}
+
+static int RunPatch(PatchTask* t) {
+    return applypatch(t->args.source_filename, t->args.target_filename,
+                      t->args.target_sha1, t->args.target_size,
+                      t->args.patchcount, t->args.patch_sha_str,
+                      t->args.patches, NULL);
+}
+
+static void* PatchWorker(void* cookie) {
+    PatchTask* t = (PatchTask*)cookie;
+    int result = applypatch_without_cache(
+        t->args.source_filename, t->args.target_filename,
+        t->args.target_sha1, t->args.target_size,
+        t->args.patchcount, t->args.patch_sha_str,
+        t->args.patches, NULL);
+
+    Scheduler* sched = t->sched;
+    pthread_mutex_lock(&sched->lock);
+    t->result = result;
+    t->state = TASK_DONE;
+    --sched->running;
+    sched->memory_in_use -= t->memory;
+    if (result != 0) ++sched->failures;
+    pthread_cond_broadcast(&sched->done);
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+// Return nonzero if task t (which comes after all the tasks in
+// [first, last)) can be started on a worker now.  Called with the
+// scheduler locked.
+static int CanStart(Scheduler* sched, PatchTask* tasks, int first, int last,
+                    PatchTask* t, int max_threads, size_t memory_budget) {
+    if (t->errmsg != NULL || t->partition) return 0;
+    if (sched->running >= max_threads) return 0;
+    if (sched->running > 0 &&
+        sched->memory_in_use + t->memory > memory_budget) {
+        return 0;
+    }
+
+    size_t reserved = 0;
+    int i;
+    for (i = first; i < last; ++i) {
+        PatchTask* r = tasks + i;
+        if (r->state != TASK_RUNNING) continue;
+        if (strcmp(r->target, t->target) == 0 ||
+            strcmp(r->target, t->args.source_filename) == 0 ||
+            strcmp(r->args.source_filename, t->target) == 0) {
+            return 0;
+        }
+        if (strcmp(r->target_fs, t->target_fs) == 0) {
+            reserved += r->args.target_size;
+        }
+    }
+
+    size_t wanted = t->args.target_size * 3 / 2;
+    if (wanted < MIN_TARGET_FREE) wanted = MIN_TARGET_FREE;
+    size_t free_space = FreeSpaceForFile(t->target_fs);
+    if (free_space == (size_t)(-1) || free_space <= reserved ||
+        free_space - reserved <= wanted) {
+        return 0;
+    }
+    return 1;
+}
+
+// The value "apply_patch(...)" or "apply_patch(...) || expr" would
+// have produced, given the result of applypatch().
+static Value* PatchValue(State* state, PatchTask* t, int result) {
+    if (result == 0) {
+        return StringValue(strdup("t"));
+    }
+    if (t->on_failure != NULL) {
+        return EvaluateValue(state, t->on_failure);
+    }
+    return StringValue(strdup(""));
+}
+
+static size_t MemoryBudget() {
+    struct sysinfo si;
+    if (sysinfo(&si) != 0) {
+        return (size_t)(-1);
+    }
+    unsigned long long avail =
+        (si.freeram + si.bufferram) * (unsigned long long)si.mem_unit;
+    return avail / 2;
+}
+
+Value* ParallelApplyPatchFn(const char* name, State* state,
+                            int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return ErrorAbort(state, "%s() expects at least 1 arg", name);
+    }
+
+    PlanPatches(state);
+
+    Scheduler sched;
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.done, NULL);
+    sched.running = 0;
+    sched.failures = 0;
+    sched.memory_in_use = 0;
+
+    PatchTask* tasks = malloc(argc * sizeof(PatchTask));
+    int i;
+    for (i = 0; i < argc; ++i) {
+        SetUpTask(tasks + i, argv[i], &sched);
+    }
+
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1) max_threads = 1;
+    size_t memory_budget = MemoryBudget();
+    FILE* cmd_pipe = ((UpdaterInfo*)(state->cookie))->cmd_pipe;
+
+    Value* result = NULL;
+    int resolved = 0;       // tasks before this have been resolved
+    int next = 0;           // tasks before this have been started
+    while (resolved < argc) {
+        // Start as many of the following calls as we can.
+        pthread_mutex_lock(&sched.lock);
+        while (next < argc && sched.failures == 0) {
+            PatchTask* t = tasks + next;
+            if (t->call == NULL) break;
+            if (!t->prepared) {
+                pthread_mutex_unlock(&sched.lock);
+                PrepareTask(state, t);
+                pthread_mutex_lock(&sched.lock);
+            }
+            if (!CanStart(&sched, tasks, resolved, next, t,
+                          max_threads, memory_budget)) {
+                break;
+            }
+            t->state = TASK_RUNNING;
+            ++sched.running;
+            sched.memory_in_use += t->memory;
+            if (pthread_create(&t->thread, NULL, PatchWorker, t) != 0) {
+                // Carry on with the threads we have (or none).
+                t->state = TASK_WAITING;
+                --sched.running;
+                sched.memory_in_use -= t->memory;
+                max_threads = sched.running;
+                break;
+            }
+            ++next;
+        }
+
+        PatchTask* head = tasks + resolved;
+        if (head->state == TASK_RUNNING) {
+            pthread_cond_wait(&sched.done, &sched.lock);
+            pthread_mutex_unlock(&sched.lock);
+            continue;
+        }
+        if (head->state == TASK_DONE && head->result != 0) {
+            --sched.failures;
+        }
+        pthread_mutex_unlock(&sched.lock);
+
+        // Resolve the first unresolved argument.  If it wasn't started
+        // on a worker, everything before it has been resolved and
+        // nothing is running, so it can run here.
+        Value* v;
+        if (head->state == TASK_DONE) {
+            pthread_join(head->thread, NULL);
+            int r = head->result;
+            if (r == APPLYPATCH_NEEDS_CACHE) {
+                // Nothing new has started since it failed; let the
+                // rest finish, and run it again here with /cache to
+                // itself.
+                pthread_mutex_lock(&sched.lock);
+                while (sched.running > 0) {
+                    pthread_cond_wait(&sched.done, &sched.lock);
+                }
+                pthread_mutex_unlock(&sched.lock);
+                r = RunPatch(head);
+            }
+            v = PatchValue(state, head, r);
+        } else if (head->call == NULL) {
+            v = EvaluateValue(state, argv[resolved]);
+        } else {
+            if (!head->prepared) {
+                PrepareTask(state, head);
+            }
+            if (head->errmsg != NULL) {
+                free(state->errmsg);
+                state->errmsg = head->errmsg;
+                head->errmsg = NULL;
+                v = NULL;
+            } else {
+                v = PatchValue(state, head, RunPatch(head));
+            }
+        }
+        FreeTask(head);
+        ++resolved;
+        if (next < resolved) next = resolved;
+
+        FreeValue(result);
+        result = v;
+        if (result == NULL) break;
+
+        fprintf(cmd_pipe, "set_progress %f\n", (float)resolved / argc);
+    }
+
+    // After an abort, wait for the calls still running.
+    for (i = resolved; i < argc; ++i) {
+        if (tasks[i].state != TASK_WAITING) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+        FreeTask(tasks + i);
+    }
+    free(tasks);
+    pthread_cond_destroy(&sched.done);
+    pthread_mutex_destroy(&sched.lock);
+
+    return result;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PATCHSCHED_H_
+#define _UPDATER_PATCHSCHED_H_
+
+#include <sys/types.h>
+
+#include "edify/expr.h"
+
+// The evaluated arguments of one apply_patch() call.
+typedef struct {
+    char* source_filename;
+    char* target_filename;
+    char* target_sha1;
+    size_t target_size;
+    int patchcount;
+    char** patch_sha_str;
+    Value** patches;
+} PatchArgs;
+
+// Evaluate and check the arguments of apply_patch(); argc and argv
+// are those of the call.  Returns 0 on success, or sets an error in
+// state and returns -1.
+int ReadPatchArgs(const char* name, State* state, int argc, Expr* argv[],
+                  PatchArgs* args);
+void FreePatchArgs(PatchArgs* args);
+
+// parallel_apply_patch(expr, ...)
+//
+// Evaluates its arguments in order, like a sequence, except that
+// arguments of the form "apply_patch(...)" or "apply_patch(...) ||
+// expr" are patched on a pool of worker threads.
+Value* ParallelApplyPatchFn(const char* name, State* state,
+                            int argc, Expr* argv[]);
+
+#endif
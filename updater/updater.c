@@ -21,7 +21,10 @@
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "blockimg.h"
+#include "patchplan.h"
 #include "minzip/Zip.h"
+#include "minzip/LabelCache.h"
 
 // Generated by the makefile, this function defines the
 // RegisterDeviceExtensions() function, which calls all the
@@ -32,8 +35,22 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// If UPDATER_PROFILE is set in the environment (eg with setenv in the
+// recovery service's init.rc entry), the cost of each top-level call
+// in the script is reported in the log and written here.
+#define PROFILE_FILE "/cache/recovery/last_install_profile"
+
 struct selabel_handle *sehandle;
 
+typedef struct {
+    ValueStorage storage;
+    ZipArchive* za;
+} PackageStorage;
+
+static void ClosePackage(ValueStorage* storage) {
+    mzCloseZipArchive(((PackageStorage*)storage)->za);
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -91,6 +108,7 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
@@ -104,6 +122,11 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    root = CompileExpr(root, script, &error_count);
+    if (error_count > 0) {
+        fprintf(stderr, "%d errors compiling script\n", error_count);
+        return 6;
+    }
 
     struct selinux_opt seopts[] = {
       { SELABEL_OPT_PATH, "/file_contexts" }
@@ -114,6 +137,8 @@ int main(int argc, char** argv) {
     if (!sehandle) {
         fprintf(stderr, "Warning:  No file_contexts\n");
         fprintf(cmd_pipe, "ui_print Warning: No file_contexts\n");
+    } else {
+        labelCacheInit(sehandle, seopts[0].value);
     }
 
     // Evaluate the parsed script.
@@ -123,12 +148,32 @@ int main(int argc, char** argv) {
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
 
+    PackageStorage package_storage;
+    package_storage.storage.refcount = 1;
+    package_storage.storage.release = ClosePackage;
+    package_storage.storage.base = za.map.addr;
+    package_storage.storage.length = za.map.length;
+    package_storage.za = &za;
+    RegisterValueStorage(&package_storage.storage);
+    updater_info.package_storage = &package_storage.storage;
+
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
+    SetPatchPlanScript(root);
+
+    int profile = getenv("UPDATER_PROFILE") != NULL;
+    if (profile) {
+        StartProfiling();
+    }
+
     char* result = Evaluate(&state, root);
+
+    if (profile) {
+        WriteProfile(&state, PROFILE_FILE);
+    }
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
@@ -149,9 +194,7 @@ int main(int argc, char** argv) {
         free(result);
     }
 
-    if (updater_info.package_zip) {
-        mzCloseZipArchive(updater_info.package_zip);
-    }
+    ReleaseValueStorage(updater_info.package_storage);
     free(script);
 
     return 0;
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include "minzip/Zip.h"
+#include "edify/expr.h"
 
 #include <selinux/selinux.h>
 #include <selinux/label.h>
@@ -27,6 +28,9 @@ typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    // Holds the package mapping open for blobs that point into it;
+    // the archive is closed when the last reference is released.
+    ValueStorage* package_storage;
 } UpdaterInfo;
 
 extern struct selabel_handle *sehandle;